@@ -0,0 +1,368 @@
+/*
+ * codec_bench.c
+ *      Micro-benchmark of the encodings.h codecs.
+ *
+ * Measures encoding and decoding throughput of varint and bit packing for
+ * different bit widths, value distributions and array sizes. Doesn't need
+ * PostgreSQL, build and run it with:
+ *
+ *     make -C bench
+ *
+ * Usage: codec_bench [-q] [-n size]
+ *     -q       quick run (shorter measurements, fewer sizes);
+ *     -n size  only benchmark arrays of the given size.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../encodings.h"
+
+/*
+ * encodings.h declarations
+ *
+ * Emit external definitions of the inline functions in case compiler decides
+ * not to inline them.
+ */
+uint64_t bitpack_mask(uint8_t num_bits);
+uint64_t bitpack_load(const uint8_t *buf, const uint8_t *end);
+uint8_t *varint_encode(uint8_t *buf, uint64_t val);
+uint8_t *varint_decode(uint8_t *buf, uint64_t *out);
+uint8_t *bitpack_encode(uint8_t *buf, const uint64_t *vals, uint32_t nvals, uint8_t num_bits);
+uint8_t *bitpack_decode(uint8_t *buf, uint64_t *out, uint32_t nvals, uint8_t num_bits);
+uint64_t zigzag_encode(int64_t value);
+int64_t zigzag_decode(uint64_t value);
+void bitpack_iter_init(BitpackIter *it, uint8_t *buf, uint8_t num_bits,
+                       uint64_t nvals);
+uint64_t bitpack_iter_next(BitpackIter *it);
+uint8_t *bitpack_iter_finish(BitpackIter *it);
+uint64_t bitpack_get(const uint8_t *buf, uint64_t idx, uint8_t num_bits);
+void bitpack_set(uint8_t *buf, uint64_t idx, uint8_t num_bits, uint64_t val);
+uint64_t hash64(uint64_t x);
+
+
+typedef enum
+{
+    DIST_UNIFORM,       /* uniformly distributed within bit width */
+    DIST_SKEWED,        /* mostly small values, the larger the rarer */
+    DIST_SORTED,        /* uniform values in ascending order */
+    DIST_OUTLIERS,      /* small values with 1% of full width outliers */
+    NUM_DISTRIBUTIONS
+} Distribution;
+
+static const char *dist_names[] = {"uniform", "skewed", "sorted", "outliers"};
+
+typedef enum
+{
+    CODEC_VARINT_ENCODE,
+    CODEC_VARINT_DECODE,
+    CODEC_BITPACK_ENCODE,
+    CODEC_BITPACK_DECODE,
+    CODEC_BITPACK_ITER,
+    CODEC_BITPACK_GET,
+    NUM_CODECS
+} Codec;
+
+static const char *codec_names[] = {
+    "varint enc", "varint dec", "bitpack enc", "bitpack dec", "bp iter", "bp get"
+};
+
+/* bit widths measured in the first table */
+static const uint8_t widths[] = {1, 2, 4, 7, 8, 12, 16, 20, 24, 32, 40, 48, 56, 63, 64};
+
+/* array sizes measured in the second table */
+static const uint32_t sizes[] = {16, 256, 4096, 65536};
+
+/* minimum duration of a single measurement */
+static uint64_t min_time_ns = 50 * 1000 * 1000;
+
+/* keeps compiler from optimizing decoding away */
+static volatile uint64_t sink;
+
+static uint64_t rng_state = 0x2545f4914f6cdd1dULL;
+
+
+static inline uint64_t rng_next(void)
+{
+    rng_state += 0x9e3779b97f4a7c15ULL;
+    return hash64(rng_state);
+}
+
+static inline uint64_t width_mask(uint8_t num_bits)
+{
+    return num_bits < 64 ? ((uint64_t) 1 << num_bits) - 1 : ~(uint64_t) 0;
+}
+
+static inline uint8_t bits_required(uint64_t val)
+{
+    return val ? 64 - __builtin_clzll(val) : 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * generate
+ *      Fill the array with values of the given distribution no wider than
+ *      num_bits. The widest value always takes exactly num_bits, so that bit
+ *      packing uses the requested width.
+ */
+static void generate(uint64_t *vals, uint32_t n, Distribution dist,
+                     uint8_t num_bits)
+{
+    uint64_t mask = width_mask(num_bits);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        uint64_t r = rng_next();
+
+        switch (dist) {
+            case DIST_UNIFORM:
+            case DIST_SORTED:
+                vals[i] = r & mask;
+                break;
+            case DIST_SKEWED:
+                /* width of a value is geometrically distributed */
+                vals[i] = r & width_mask(__builtin_ctzll(rng_next() | (1ULL << 63)) + 1) & mask;
+                break;
+            case DIST_OUTLIERS:
+                vals[i] = r % 100 == 0 ? r & mask : r & 0xff & mask;
+                break;
+            default:
+                abort();
+        }
+    }
+
+    vals[rng_next() % n] |= (uint64_t) 1 << (num_bits - 1);
+
+    if (dist == DIST_SORTED)
+        qsort(vals, n, sizeof(uint64_t), cmp_uint64);
+}
+
+static uint8_t *varint_encode_all(uint8_t *buf, const uint64_t *vals, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; ++i)
+        buf = varint_encode(buf, vals[i]);
+
+    return buf;
+}
+
+/*
+ * run_codec
+ *      Run single pass of the codec over the array. Returns checksum.
+ */
+static uint64_t run_codec(Codec codec, const uint64_t *vals, uint64_t *out,
+                          uint8_t *buf, uint32_t n, uint8_t num_bits)
+{
+    uint64_t    sum = 0;
+    uint8_t    *p = buf;
+
+    switch (codec) {
+        case CODEC_VARINT_ENCODE:
+            return varint_encode_all(buf, vals, n) - buf;
+        case CODEC_VARINT_DECODE:
+            for (uint32_t i = 0; i < n; ++i) {
+                p = varint_decode(p, &out[i]);
+                sum += out[i];
+            }
+            return sum;
+        case CODEC_BITPACK_ENCODE:
+            return bitpack_encode(buf, vals, n, num_bits) - buf;
+        case CODEC_BITPACK_DECODE:
+            bitpack_decode(buf, out, n, num_bits);
+            return out[n - 1];
+        case CODEC_BITPACK_ITER: {
+            BitpackIter it;
+
+            bitpack_iter_init(&it, buf, num_bits, n);
+            for (uint32_t i = 0; i < n; ++i)
+                sum += bitpack_iter_next(&it);
+            return sum;
+        }
+        case CODEC_BITPACK_GET:
+            /* pseudo random order, n is a power of two */
+            for (uint32_t i = 0; i < n; ++i)
+                sum += bitpack_get(buf, (i * 2654435761U) & (n - 1), num_bits);
+            return sum;
+        default:
+            abort();
+    }
+}
+
+/*
+ * measure
+ *      Returns average time per value in nanoseconds.
+ */
+static double measure(Codec codec, const uint64_t *vals, uint64_t *out,
+                      uint8_t *buf, uint32_t n, uint8_t num_bits)
+{
+    uint64_t    start;
+    uint64_t    elapsed;
+    uint64_t    iters = 0;
+    uint64_t    batch = 1;
+
+    /* prepare encoded data for decoders */
+    if (codec == CODEC_VARINT_DECODE)
+        varint_encode_all(buf, vals, n);
+    else if (codec != CODEC_VARINT_ENCODE)
+        bitpack_encode(buf, vals, n, num_bits);
+
+    /* warm up */
+    sink += run_codec(codec, vals, out, buf, n, num_bits);
+
+    start = now_ns();
+    do {
+        for (uint64_t i = 0; i < batch; ++i)
+            sink += run_codec(codec, vals, out, buf, n, num_bits);
+        iters += batch;
+        batch *= 2;
+        elapsed = now_ns() - start;
+    } while (elapsed < min_time_ns);
+
+    return (double) elapsed / iters / n;
+}
+
+static void verify(const uint64_t *vals, uint64_t *out, uint8_t *buf,
+                   uint32_t n, uint8_t num_bits)
+{
+    uint8_t *p = buf;
+
+    varint_encode_all(buf, vals, n);
+    for (uint32_t i = 0; i < n; ++i) {
+        p = varint_decode(p, &out[i]);
+        if (out[i] != vals[i]) {
+            fprintf(stderr, "varint mismatch at %u\n", i);
+            exit(1);
+        }
+    }
+
+    bitpack_encode(buf, vals, n, num_bits);
+    bitpack_decode(buf, out, n, num_bits);
+    for (uint32_t i = 0; i < n; ++i)
+        if (out[i] != vals[i] || bitpack_get(buf, i, num_bits) != vals[i]) {
+            fprintf(stderr, "bitpack mismatch at %u (%u bits)\n", i, num_bits);
+            exit(1);
+        }
+}
+
+static void print_header(const char *first)
+{
+    printf("%-20s", first);
+    for (int c = 0; c < NUM_CODECS; ++c)
+        printf(" %11s", codec_names[c]);
+    printf(" %10s %10s\n", "varint B/v", "bitpack B/v");
+}
+
+/*
+ * bench_row
+ *      Measure all codecs on the array and print a row of the table.
+ */
+static void bench_row(const char *label, const uint64_t *vals, uint32_t n,
+                      uint64_t *out, uint8_t *buf)
+{
+    uint64_t    max = 0;
+    uint8_t     num_bits;
+    size_t      varint_size;
+
+    for (uint32_t i = 0; i < n; ++i)
+        max = max > vals[i] ? max : vals[i];
+    num_bits = bits_required(max);
+
+    verify(vals, out, buf, n, num_bits);
+    varint_size = varint_encode_all(buf, vals, n) - buf;
+
+    printf("%-20s", label);
+    for (int c = 0; c < NUM_CODECS; ++c)
+        printf(" %11.2f", measure(c, vals, out, buf, n, num_bits));
+    printf(" %10.2f %10.2f\n", (double) varint_size / n,
+           (double) ((n * num_bits + 7) / 8) / n);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t    nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    uint32_t    only_size = 0;
+    uint32_t    max_size = 0;
+    uint64_t   *vals;
+    uint64_t   *out;
+    uint8_t    *buf;
+    char        label[64];
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-q") == 0) {
+            min_time_ns /= 10;
+            nsizes -= 1;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            only_size = strtoul(argv[++i], NULL, 10);
+            if (only_size == 0 || (only_size & (only_size - 1)) != 0) {
+                fprintf(stderr, "size must be a power of two\n");
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "usage: %s [-q] [-n size]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (uint32_t s = 0; s < nsizes; ++s)
+        max_size = max_size > sizes[s] ? max_size : sizes[s];
+    max_size = max_size > only_size ? max_size : only_size;
+
+    /*
+     * Varint takes up to 10 bytes per value. Bit-packing writes and reads
+     * only the bytes holding the values, so no slack is needed past them.
+     */
+    vals = malloc(max_size * sizeof(uint64_t));
+    out = malloc(max_size * sizeof(uint64_t));
+    buf = calloc(max_size * 10, 1);
+    if (!vals || !out || !buf) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    printf("ns/value by bit width (uniform distribution, %u values)\n",
+           only_size ? only_size : 4096);
+    print_header("bits");
+    for (uint32_t w = 0; w < sizeof(widths); ++w) {
+        uint32_t n = only_size ? only_size : 4096;
+
+        generate(vals, n, DIST_UNIFORM, widths[w]);
+        snprintf(label, sizeof(label), "%u", widths[w]);
+        bench_row(label, vals, n, out, buf);
+    }
+
+    printf("\nns/value by distribution and size (up to 20 bits)\n");
+    print_header("distribution/size");
+    for (int d = 0; d < NUM_DISTRIBUTIONS; ++d)
+        for (uint32_t s = 0; s < nsizes; ++s) {
+            uint32_t n = only_size ? only_size : sizes[s];
+
+            generate(vals, n, d, 20);
+            snprintf(label, sizeof(label), "%s/%u", dist_names[d], n);
+            bench_row(label, vals, n, out, buf);
+
+            if (only_size)
+                break;
+        }
+
+    free(vals);
+    free(out);
+    free(buf);
+
+    return 0;
+}
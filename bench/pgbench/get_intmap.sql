@@ -0,0 +1,3 @@
+\set id random(1, :nrows)
+\set key random(1, :nkeys)
+select im -> :key from bench_maps where id = :id;
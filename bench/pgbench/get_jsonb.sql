@@ -0,0 +1,3 @@
+\set id random(1, :nrows)
+\set key random(1, :nkeys)
+select (js ->> :key::text)::int8 from bench_maps where id = :id;
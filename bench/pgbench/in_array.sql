@@ -0,0 +1,2 @@
+\set id random(1, :nrows)
+select arr_text::int8[] from bench_maps where id = :id;
@@ -0,0 +1,2 @@
+\set id random(1, :nrows)
+select hs_text::hstore from bench_maps where id = :id;
@@ -0,0 +1,2 @@
+\set id random(1, :nrows)
+select im_text::intmap from bench_maps where id = :id;
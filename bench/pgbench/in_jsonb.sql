@@ -0,0 +1,2 @@
+\set id random(1, :nrows)
+select js_text::jsonb from bench_maps where id = :id;
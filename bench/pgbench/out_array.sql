@@ -0,0 +1,2 @@
+\set id random(1, :nrows)
+select arr::text from bench_maps where id = :id;
@@ -0,0 +1,2 @@
+\set id random(1, :nrows)
+select hs::text from bench_maps where id = :id;
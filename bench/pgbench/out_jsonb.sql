@@ -0,0 +1,2 @@
+\set id random(1, :nrows)
+select js::text from bench_maps where id = :id;
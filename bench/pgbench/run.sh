@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Compare intmap with hstore, jsonb and int8[]: single key lookup (get),
+# input (in) and output (out) functions.
+#
+# Usage: run.sh [dbname]
+#
+# Environment variables:
+#   NROWS   number of maps (10000)
+#   NKEYS   number of keys per map (100)
+#   TIME    duration of each run in seconds (10)
+#   CLIENTS number of pgbench clients (1)
+set -e
+
+DB=${1:-postgres}
+NROWS=${NROWS:-10000}
+NKEYS=${NKEYS:-100}
+TIME=${TIME:-10}
+CLIENTS=${CLIENTS:-1}
+
+cd "$(dirname "$0")"
+
+psql -X -q -d "$DB" -v ON_ERROR_STOP=1 -v nrows="$NROWS" -v nkeys="$NKEYS" \
+    -f setup.sql
+
+printf '%-4s %-8s %12s %14s\n' op type tps "latency (ms)"
+for op in get in out; do
+    for type in intmap hstore jsonb array; do
+        pgbench -n -T "$TIME" -c "$CLIENTS" -D nrows="$NROWS" \
+            -D nkeys="$NKEYS" -f "${op}_${type}.sql" "$DB" |
+            awk -v op="$op" -v type="$type" '
+                /^latency average/ { lat = $4 }
+                /^tps/ { tps = $3 }
+                END { printf "%-4s %-8s %12.0f %14.3f\n", op, type, tps, lat }'
+    done
+done
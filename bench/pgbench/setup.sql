@@ -0,0 +1,46 @@
+-- Test data for the pgbench scripts. Every row holds the same map in each
+-- representation: intmap, hstore, jsonb and int8[] (where the key is the
+-- array subscript). Text columns are used to benchmark input functions.
+--
+-- Usage: psql -v nrows=10000 -v nkeys=100 -f setup.sql
+create extension if not exists pg_intmap;
+create extension if not exists hstore;
+
+drop table if exists bench_maps;
+create table bench_maps (
+    id      int primary key,
+    im      intmap,
+    hs      hstore,
+    js      jsonb,
+    arr     int8[],
+    im_text text,
+    hs_text text,
+    js_text text,
+    arr_text text
+);
+
+insert into bench_maps (id, arr)
+    select id, array(select (random() * 1000000)::int8
+                     from generate_series(1, :nkeys)
+                     where id is not null)
+    from generate_series(1, :nrows) id;
+
+update bench_maps set
+    im = intmap(array(select generate_series(1, array_length(arr, 1))), arr),
+    hs = hstore(array(select generate_series(1, array_length(arr, 1)))::text[],
+                arr::text[]),
+    js = (select jsonb_object_agg(k, v) from unnest(arr) with ordinality u(v, k));
+
+update bench_maps set
+    im_text = im::text,
+    hs_text = hs::text,
+    js_text = js::text,
+    arr_text = arr::text;
+
+vacuum analyze bench_maps;
+
+select pg_size_pretty(sum(pg_column_size(im))) as intmap,
+       pg_size_pretty(sum(pg_column_size(hs))) as hstore,
+       pg_size_pretty(sum(pg_column_size(js))) as jsonb,
+       pg_size_pretty(sum(pg_column_size(arr))) as int8_array
+    from bench_maps;
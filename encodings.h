@@ -12,6 +12,7 @@
 typedef struct
 {
     uint8_t    *buf;
+    uint8_t    *end;        /* end of the packed values */
     uint64_t    mask;
     uint8_t     num_bits;
     uint8_t     bits_read;
@@ -19,6 +20,36 @@ typedef struct
 } BitpackIter;
 
 
+/*
+ * bitpack_mask
+ *      Mask of the lower num_bits bits. Shifting a 64 bit value by 64 is
+ *      undefined, so full width is handled separately.
+ */
+inline uint64_t bitpack_mask(uint8_t num_bits)
+{
+    return num_bits < INT64_BITSIZE ? ~((uint64_t)-1 << num_bits) : (uint64_t)-1;
+}
+
+/*
+ * bitpack_load
+ *      Load the 64 bit word at buf, reading nothing at or past end. Missing
+ *      bytes read as zeros.
+ *
+ * The last word of packed values is usually partial and may be the last
+ * bytes of the datum, so it can't be read as a whole.
+ */
+inline uint64_t bitpack_load(const uint8_t *buf, const uint8_t *end)
+{
+    uint64_t t = 0;
+
+    if (end - buf >= (long) sizeof(uint64_t))
+        memcpy(&t, buf, sizeof(uint64_t));
+    else if (end > buf)
+        memcpy(&t, buf, end - buf);
+
+    return t;
+}
+
 inline uint8_t *varint_encode(uint8_t *buf, uint64_t val)
 {
     uint64_t res = 0;
@@ -46,11 +77,18 @@ inline uint8_t *varint_decode(uint8_t *buf, uint64_t *out)
     return buf + 1;
 }
 
+/*
+ * bitpack_encode
+ *      Pack values back to back into 64 bit words.
+ *
+ * Only the bytes actually used by the last word are written, so the output
+ * takes exactly (nvals * num_bits + 7) / 8 bytes.
+ */
 inline uint8_t *bitpack_encode(uint8_t *buf, const uint64_t *vals, uint32_t nvals, uint8_t num_bits)
 {
     uint32_t i = 0;
     uint64_t t = 0;
-    uint64_t mask = ~((uint64_t)-1 << num_bits);
+    uint64_t mask = bitpack_mask(num_bits);
     uint8_t bits_used = 0;
 
     while(i < nvals)
@@ -65,31 +103,35 @@ inline uint8_t *bitpack_encode(uint8_t *buf, const uint64_t *vals, uint32_t nval
             memcpy(buf, (void *) &t, sizeof(uint64_t));
             buf += sizeof(uint64_t);
 
-            t = (vals[i] & mask) >> (num_bits - diff);
+            /* the rest of the value, if any, goes to the next word */
+            t = diff > 0 ? (vals[i] & mask) >> (num_bits - diff) : 0;
             bits_used = diff;
         }
         i++;
     }
 
-    if (bits_used > 0)
-        memcpy(buf, (void *) &t, sizeof(uint64_t));
-
     /* 
      * how many bytes used:
      * (bits + sizeof(uint8_t) - 1) / sizeof(uint8_t)
      */
     uint8_t bytes_used = (bits_used + 7) >> 3;
+
+    memcpy(buf, (void *) &t, bytes_used);
     return buf + bytes_used;
 }
 
 inline uint8_t *bitpack_decode(uint8_t *buf, uint64_t *out, uint32_t nvals, uint8_t num_bits)
 {
     uint32_t i = 0;
-    uint64_t mask = ~((uint64_t)-1 << num_bits);
+    uint64_t mask = bitpack_mask(num_bits);
     uint8_t bits_read = 0;
+    uint8_t *end = buf + ((uint64_t) nvals * num_bits + 7) / 8;
     uint64_t t;
 
-    memcpy(&t, buf, sizeof(uint64_t));
+    if (nvals == 0)
+        return buf;
+
+    t = bitpack_load(buf, end);
     while (i < nvals) {
         *out = t & mask;
         bits_read += num_bits;
@@ -99,14 +141,14 @@ inline uint8_t *bitpack_decode(uint8_t *buf, uint64_t *out, uint32_t nvals, uint
             uint8_t shift = num_bits - diff; 
 
             buf += sizeof(uint64_t);
-            memcpy(&t, buf, sizeof(uint64_t));
+            t = bitpack_load(buf, end);
 
             *out |= (t & (mask >> shift)) << shift;
-            t >>= shift;
+            t = diff < INT64_BITSIZE ? t >> diff : 0;
             bits_read = diff;
         }
         else
-            t >>= num_bits;
+            t = num_bits < INT64_BITSIZE ? t >> num_bits : 0;
         out++;
         i++;
     }
@@ -119,13 +161,15 @@ inline uint8_t *bitpack_decode(uint8_t *buf, uint64_t *out, uint32_t nvals, uint
     return buf + bytes_read;
 }
 
-inline void bitpack_iter_init(BitpackIter *it, uint8_t *buf, uint8_t num_bits)
+inline void bitpack_iter_init(BitpackIter *it, uint8_t *buf, uint8_t num_bits,
+                              uint64_t nvals)
 {
     it->buf = buf;
-    it->mask = ~((uint64_t)-1 << num_bits);
+    it->end = buf + (nvals * num_bits + 7) / 8;
+    it->mask = bitpack_mask(num_bits);
     it->num_bits = num_bits;
     it->bits_read = 0;
-    memcpy(&it->reg, buf, sizeof(uint64_t));
+    it->reg = bitpack_load(buf, it->end);
 }
 
 inline uint8_t *bitpack_iter_finish(BitpackIter *it)
@@ -152,18 +196,86 @@ inline uint64_t bitpack_iter_next(BitpackIter *it)
         uint8_t shift = it->num_bits - diff;
 
         it->buf += sizeof(uint64_t);
-        memcpy(&it->reg, it->buf, sizeof(uint64_t));
+        it->reg = bitpack_load(it->buf, it->end);
 
         out |= (it->reg & (it->mask >> shift)) << shift;
-        it->reg >>= diff;
+        it->reg = diff < INT64_BITSIZE ? it->reg >> diff : 0;
         it->bits_read = diff;
     }
     else
-        it->reg >>= it->num_bits;
+        it->reg = it->num_bits < INT64_BITSIZE ? it->reg >> it->num_bits : 0;
 
     return out;
 }
 
+/*
+ * bitpack_get
+ *      Random access to the idx'th value of a bit packed sequence.
+ *
+ * Relies on the same layout as bitpack_encode(): values are packed back to
+ * back into 64 bit words, a value may span two adjacent words. Nothing past
+ * the last byte of the value is read.
+ */
+inline uint64_t bitpack_get(const uint8_t *buf, uint64_t idx, uint8_t num_bits)
+{
+    uint64_t bitoff = idx * num_bits;
+    uint64_t mask = bitpack_mask(num_bits);
+    uint8_t  shift = bitoff & (INT64_BITSIZE - 1);
+    const uint8_t *end = buf + (bitoff + num_bits + 7) / 8;
+    uint64_t t;
+    uint64_t out;
+
+    if (num_bits == 0)
+        return 0;
+
+    buf += (bitoff / INT64_BITSIZE) * sizeof(uint64_t);
+    t = bitpack_load(buf, end);
+    out = t >> shift;
+
+    if (shift + num_bits > INT64_BITSIZE) {
+        t = bitpack_load(buf + sizeof(uint64_t), end);
+        out |= t << (INT64_BITSIZE - shift);
+    }
+
+    return out & mask;
+}
+
+/*
+ * bitpack_set
+ *      Overwrite the idx'th value of a bit packed sequence. The value must fit
+ *      into num_bits. Like bitpack_get(), touches nothing past the value.
+ */
+inline void bitpack_set(uint8_t *buf, uint64_t idx, uint8_t num_bits, uint64_t val)
+{
+    uint64_t bitoff = idx * num_bits;
+    uint64_t mask = bitpack_mask(num_bits);
+    uint8_t  shift = bitoff & (INT64_BITSIZE - 1);
+    uint8_t *end = buf + (bitoff + num_bits + 7) / 8;
+    uint64_t t;
+
+    if (num_bits == 0)
+        return;
+
+    val &= mask;
+    buf += (bitoff / INT64_BITSIZE) * sizeof(uint64_t);
+    t = bitpack_load(buf, end);
+    t = (t & ~(mask << shift)) | (val << shift);
+    if (end - buf >= (long) sizeof(uint64_t))
+        memcpy(buf, &t, sizeof(uint64_t));
+    else
+        memcpy(buf, &t, end - buf);
+
+    /* the rest of the value goes to the next word */
+    if (shift + num_bits > INT64_BITSIZE) {
+        uint8_t written = INT64_BITSIZE - shift;
+
+        buf += sizeof(uint64_t);
+        t = bitpack_load(buf, end);
+        t = (t & ~(mask >> written)) | (val >> written);
+        memcpy(buf, &t, end - buf);
+    }
+}
+
 inline uint64_t zigzag_encode(int64_t value)
 {
     return (value << 1) ^ (value >> (INT64_BITSIZE - 1));
@@ -179,4 +291,22 @@ inline int64_t zigzag_decode(uint64_t value)
     return ((int64_t) value << INT64_BITSIZE - 1 >> INT64_BITSIZE - 1) ^ (value >> 1);
 }
 
+/*
+ * hash64
+ *      64 bit integer mixing function (splitmix64 finalizer).
+ *
+ * The result is stored on disk as part of hash layout, so it must never
+ * change.
+ */
+inline uint64_t hash64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+
+    return x;
+}
+
 #endif
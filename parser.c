@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include "postgres.h"
 
 
@@ -29,12 +30,15 @@ static inline const char* parse_int(const char *c, int64_t *out)
 static inline void intmap_qsort_internal(int64_t *keys, int64_t *values,
                                          int32_t low, int32_t high)
 {
-    int64_t mid = keys[(low + high) / 2];
+    int64_t mid;
     int32_t i = low, j = high - 1;
 
-    if (low >= high)
+    if (low >= high - 1)
         return;
 
+    /* lower middle, so that the pivot is never the last element */
+    mid = keys[(low + high - 1) / 2];
+
     while (true) {
         int64_t tmp;
 
@@ -55,7 +59,8 @@ static inline void intmap_qsort_internal(int64_t *keys, int64_t *values,
         i++;
         j--;
     }
-    intmap_qsort_internal(keys, values, low, j);
+    /* [low, j] and [j + 1, high) partitions */
+    intmap_qsort_internal(keys, values, low, j + 1);
     intmap_qsort_internal(keys, values, j + 1, high);
 }
 
@@ -64,24 +69,63 @@ void intmap_qsort(int64_t *keys, int64_t *values, int32_t n)
     intmap_qsort_internal(keys, values, 0, n);
 }
 
-void parse_intmap(const char *c, int64_t **keys, int64_t **values, int *n)
+/*
+ * intmap_sort
+ *      Sort entries by key. Values are stored column by column, each column
+ *      having n values.
+ */
+void intmap_sort(int64_t *keys, int64_t *values, int32_t n, int32_t ncols)
+{
+    int64_t *perm, *tmp;
+
+    if (ncols == 1) {
+        intmap_qsort(keys, values, n);
+        return;
+    }
+
+    /* sort the permutation along with keys and then apply it to columns */
+    perm = palloc(sizeof(int64_t) * n * 2);
+    tmp = perm + n;
+    for (int32_t i = 0; i < n; ++i)
+        perm[i] = i;
+    intmap_qsort(keys, perm, n);
+
+    for (int32_t c = 0; c < ncols; ++c) {
+        int64_t *col = values + c * n;
+
+        memcpy(tmp, col, sizeof(int64_t) * n);
+        for (int32_t i = 0; i < n; ++i)
+            col[i] = tmp[perm[i]];
+    }
+    pfree(perm);
+}
+
+/*
+ * parse_intmap
+ *      Parse 'k=>v, ...' or 'k=>{v1, v2, ...}, ...' string. All entries must
+ *      have the same number of values. Values are returned column by column.
+ */
+void parse_intmap(const char *c, int64_t **keys, int64_t **values, int *n,
+                  int *ncols)
 {
     IMParseState state = IM_MAP_START;
     const char *s = c;
-    int         i = 0;
+    int64_t    *row_values;
+    int         est = 1;
+    int         nvals = 0;
 
-    /* estimate the number of key-value pairs */
-    *n = 1;
+    /* estimate the number of values; it's never less than number of keys */
     while (*s) {
         if (*s == ',')
-            (*n)++;
+            est++;
         s++;
     }
 
     /* allocate keys and values arrays */
-    *keys = palloc(sizeof(int64_t) * *n * 2);
-    *values = *keys + *n;
+    *keys = palloc(sizeof(int64_t) * est * 2);
+    row_values = *keys + est;
     *n = 0;
+    *ncols = 0;
 
     /* parse */
     while (*c) {
@@ -99,7 +143,7 @@ void parse_intmap(const char *c, int64_t **keys, int64_t **values, int *n)
                     int64_t key;
 
                     c = parse_int(c, &key);
-                    (*keys)[i] = key;
+                    (*keys)[*n] = key;
                     state = IM_KV_DELIM;
                     break;
                 }
@@ -114,9 +158,36 @@ void parse_intmap(const char *c, int64_t **keys, int64_t **values, int *n)
             case IM_VALUE:
                 {
                     int64_t val;
+                    int     cols = 0;
+
+                    if (*c != '{') {
+                        c = parse_int(c, &val);
+                        row_values[nvals++] = val;
+                        cols = 1;
+                    } else {
+                        /* list of values: {v1, v2, ...} */
+                        c++;
+                        while (true) {
+                            while (isspace(*c)) c++;
+                            c = parse_int(c, &val);
+                            row_values[nvals++] = val;
+                            cols++;
+
+                            while (isspace(*c)) c++;
+                            if (*c == '}')
+                                break;
+                            if (*c != ',')
+                                elog(ERROR, "expected ',' or '}', but found '%s'", c);
+                            c++;
+                        }
+                        c++;
+                    }
+
+                    if (*ncols == 0)
+                        *ncols = cols;
+                    else if (cols != *ncols)
+                        elog(ERROR, "all entries must have the same number of values");
 
-                    c = parse_int(c, &val);
-                    (*values)[i++] = val;
                     (*n)++;
                     state = IM_DELIM;
                     break;
@@ -137,7 +208,17 @@ void parse_intmap(const char *c, int64_t **keys, int64_t **values, int *n)
     if (state != IM_DELIM && state != IM_MAP_START)
         elog(ERROR, "unexpected end of string");
 
-    intmap_qsort(*keys, *values, *n);
+    /* empty map has a single value column */
+    if (*ncols == 0)
+        *ncols = 1;
+
+    /* transpose row-major values into columns */
+    *values = palloc(sizeof(int64_t) * (nvals > 0 ? nvals : 1));
+    for (int i = 0; i < *n; ++i)
+        for (int col = 0; col < *ncols; ++col)
+            (*values)[col * *n + i] = row_values[i * *ncols + col];
+
+    intmap_sort(*keys, *values, *n, *ncols);
 }
 
 void parse_intarr(const char *c, int64_t **values, int *n)
@@ -1,28 +1,39 @@
 CREATE FUNCTION intmap_in(cstring)
 RETURNS intmap
 AS 'pg_intmap'
-LANGUAGE C IMMUTABLE STRICT;
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
 
 CREATE FUNCTION intmap_out(intmap)
 RETURNS cstring
 AS 'pg_intmap'
-LANGUAGE C IMMUTABLE STRICT;
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
+
+CREATE FUNCTION intmap_typanalyze(internal)
+RETURNS bool
+AS 'pg_intmap'
+LANGUAGE C STRICT;
 
 CREATE TYPE intmap (
     INPUT   = intmap_in,
     OUTPUT  = intmap_out,
+    ANALYZE = intmap_typanalyze,
     STORAGE = EXTENDED
 );
 
-CREATE FUNCTION intmap(int8[], int8[])
+CREATE FUNCTION intmap(int8[], int8[], layout text DEFAULT 'sorted',
+                       bloom bool DEFAULT false)
 RETURNS intmap
 AS 'pg_intmap', 'create_intmap'
-LANGUAGE C IMMUTABLE STRICT;
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
 
 CREATE FUNCTION intmap_get_val(intmap, int8)
 RETURNS int8
 AS 'pg_intmap'
-LANGUAGE C IMMUTABLE STRICT;
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
 
 CREATE OPERATOR -> (
     leftarg   = intmap,
@@ -30,20 +41,314 @@ CREATE OPERATOR -> (
     procedure = intmap_get_val
 );
 
+CREATE FUNCTION intmap_get_val(intmap, int8, int4)
+RETURNS int8
+AS 'pg_intmap', 'intmap_get_col_val'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE FUNCTION intmap_get_vals(intmap, int8)
+RETURNS int8[]
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE FUNCTION intmap_exists(intmap, int8)
+RETURNS bool
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE FUNCTION intmap_exists_sel(internal, oid, internal, int4)
+RETURNS float8
+AS 'pg_intmap'
+LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION intmap_exists_joinsel(internal, oid, internal, int2, internal)
+RETURNS float8
+AS 'pg_intmap'
+LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE OPERATOR ? (
+    leftarg   = intmap,
+    rightarg  = int8,
+    procedure = intmap_exists,
+    restrict  = intmap_exists_sel,
+    join      = intmap_exists_joinsel
+);
+
+CREATE FUNCTION intmap_set(intmap, int8, int8)
+RETURNS intmap
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
+
+CREATE FUNCTION intmap_set(intmap, int8, int8[])
+RETURNS intmap
+AS 'pg_intmap', 'intmap_set_vals'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
+
+CREATE FUNCTION intmap_delete(intmap, int8)
+RETURNS intmap
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
+
+CREATE FUNCTION intmap_range(intmap, lo int8, hi int8)
+RETURNS intmap
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
+
+CREATE FUNCTION intmap_range_each(intmap, lo int8, hi int8,
+                                  OUT key int8, OUT value int8)
+RETURNS SETOF record
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
+
+CREATE FUNCTION intmap_topn(intmap, int4)
+RETURNS intmap
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
+
+CREATE FUNCTION intmap_filter(intmap, op text, int8)
+RETURNS intmap
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
+
+CREATE FUNCTION intmap_count_where(intmap, op text, int8)
+RETURNS int8
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
+
+CREATE FUNCTION intmap_to_arrays(intmap, OUT keys int8[], OUT vals int8[])
+RETURNS record
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
+
 CREATE FUNCTION intmap_meta(intmap)
 RETURNS cstring
 AS 'pg_intmap'
-LANGUAGE C IMMUTABLE STRICT;
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE FUNCTION intmap_info(intmap,
+                            OUT version int4,
+                            OUT nitems int8,
+                            OUT layout text,
+                            OUT columns int4,
+                            OUT header_bytes int8,
+                            OUT bloom_bytes int8,
+                            OUT keys_bytes int8,
+                            OUT values_bytes int8,
+                            OUT hash_bytes int8,
+                            OUT total_bytes int8,
+                            OUT keys_encoding text,
+                            OUT keys_bits int4,
+                            OUT values_encodings text[],
+                            OUT values_bits int4[],
+                            OUT varint_bytes int8,
+                            OUT bitpack_bytes int8,
+                            OUT best_bytes int8)
+RETURNS record
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
+
+CREATE FUNCTION intmap_storage_report(rel regclass, col name,
+                                      OUT maps int8,
+                                      OUT nitems int8,
+                                      OUT hash_maps int8,
+                                      OUT stored_bytes int8,
+                                      OUT total_bytes int8,
+                                      OUT header_bytes int8,
+                                      OUT bloom_bytes int8,
+                                      OUT keys_bytes int8,
+                                      OUT values_bytes int8,
+                                      OUT hash_bytes int8,
+                                      OUT varint_bytes int8,
+                                      OUT bitpack_bytes int8,
+                                      OUT best_bytes int8,
+                                      OUT max_keys_bits int4,
+                                      OUT max_values_bits int4)
+RETURNS record
+AS $$
+BEGIN
+    IF NOT EXISTS (SELECT 1 FROM pg_attribute
+                   WHERE attrelid = rel AND attname = col
+                     AND NOT attisdropped
+                     AND atttypid = 'intmap'::regtype) THEN
+        RAISE EXCEPTION 'column "%" of relation % is not of type intmap',
+            col, rel;
+    END IF;
+
+    EXECUTE format($q$
+        SELECT count(*),
+               coalesce(sum(i.nitems), 0)::int8,
+               count(*) FILTER (WHERE i.layout = 'hash'),
+               coalesce(sum(pg_column_size(t.%1$I)), 0)::int8,
+               coalesce(sum(i.total_bytes), 0)::int8,
+               coalesce(sum(i.header_bytes), 0)::int8,
+               coalesce(sum(i.bloom_bytes), 0)::int8,
+               coalesce(sum(i.keys_bytes), 0)::int8,
+               coalesce(sum(i.values_bytes), 0)::int8,
+               coalesce(sum(i.hash_bytes), 0)::int8,
+               coalesce(sum(i.varint_bytes), 0)::int8,
+               coalesce(sum(i.bitpack_bytes), 0)::int8,
+               coalesce(sum(i.best_bytes), 0)::int8,
+               max(i.keys_bits),
+               max((SELECT max(b) FROM unnest(i.values_bits) b))
+        FROM %2$s t, intmap_info(t.%1$I) i
+        WHERE t.%1$I IS NOT NULL
+        $q$, col, rel)
+    INTO maps, nitems, hash_maps, stored_bytes, total_bytes, header_bytes,
+         bloom_bytes, keys_bytes, values_bytes, hash_bytes, varint_bytes,
+         bitpack_bytes, best_bytes, max_keys_bits, max_values_bits;
+END
+$$
+LANGUAGE plpgsql STABLE STRICT;
+
+CREATE FUNCTION intmap_eq(intmap, intmap)
+RETURNS bool
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE FUNCTION intmap_ne(intmap, intmap)
+RETURNS bool
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE FUNCTION intmap_lt(intmap, intmap)
+RETURNS bool
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE FUNCTION intmap_le(intmap, intmap)
+RETURNS bool
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE FUNCTION intmap_gt(intmap, intmap)
+RETURNS bool
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE FUNCTION intmap_ge(intmap, intmap)
+RETURNS bool
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE FUNCTION intmap_cmp(intmap, intmap)
+RETURNS int4
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE FUNCTION intmap_hash(intmap)
+RETURNS int4
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE OPERATOR = (
+    leftarg    = intmap,
+    rightarg   = intmap,
+    procedure  = intmap_eq,
+    commutator = =,
+    negator    = <>,
+    restrict   = eqsel,
+    join       = eqjoinsel,
+    hashes,
+    merges
+);
+
+CREATE OPERATOR <> (
+    leftarg    = intmap,
+    rightarg   = intmap,
+    procedure  = intmap_ne,
+    commutator = <>,
+    negator    = =,
+    restrict   = neqsel,
+    join       = neqjoinsel
+);
+
+CREATE OPERATOR < (
+    leftarg    = intmap,
+    rightarg   = intmap,
+    procedure  = intmap_lt,
+    commutator = >,
+    negator    = >=,
+    restrict   = scalarltsel,
+    join       = scalarltjoinsel
+);
+
+CREATE OPERATOR <= (
+    leftarg    = intmap,
+    rightarg   = intmap,
+    procedure  = intmap_le,
+    commutator = >=,
+    negator    = >,
+    restrict   = scalarlesel,
+    join       = scalarlejoinsel
+);
+
+CREATE OPERATOR > (
+    leftarg    = intmap,
+    rightarg   = intmap,
+    procedure  = intmap_gt,
+    commutator = <,
+    negator    = <=,
+    restrict   = scalargtsel,
+    join       = scalargtjoinsel
+);
+
+CREATE OPERATOR >= (
+    leftarg    = intmap,
+    rightarg   = intmap,
+    procedure  = intmap_ge,
+    commutator = <=,
+    negator    = <,
+    restrict   = scalargesel,
+    join       = scalargejoinsel
+);
+
+CREATE OPERATOR CLASS intmap_ops
+DEFAULT FOR TYPE intmap USING btree AS
+    OPERATOR 1 <,
+    OPERATOR 2 <=,
+    OPERATOR 3 =,
+    OPERATOR 4 >=,
+    OPERATOR 5 >,
+    FUNCTION 1 intmap_cmp(intmap, intmap);
+
+CREATE OPERATOR CLASS intmap_hash_ops
+DEFAULT FOR TYPE intmap USING hash AS
+    OPERATOR 1 =,
+    FUNCTION 1 intmap_hash(intmap);
 
 CREATE FUNCTION intarr_in(cstring)
 RETURNS intarr
 AS 'pg_intmap'
-LANGUAGE C IMMUTABLE STRICT;
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
 
 CREATE FUNCTION intarr_out(intarr)
 RETURNS cstring
 AS 'pg_intmap'
-LANGUAGE C IMMUTABLE STRICT;
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
 
 CREATE TYPE intarr (
     INPUT   = intarr_in,
@@ -54,10 +359,170 @@ CREATE TYPE intarr (
 CREATE FUNCTION intarr_get_val(intarr, int4)
 RETURNS int8
 AS 'pg_intmap'
-LANGUAGE C IMMUTABLE STRICT;
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
 
 CREATE OPERATOR -> (
     leftarg   = intarr,
     rightarg  = int4,
     procedure = intarr_get_val
 );
+
+CREATE FUNCTION intarr_append(intarr, int8)
+RETURNS intarr
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
+
+CREATE FUNCTION intarr(int8[])
+RETURNS intarr
+AS 'pg_intmap', 'intarr_from_array'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
+
+CREATE FUNCTION intarr(int4[])
+RETURNS intarr
+AS 'pg_intmap', 'intarr_from_array'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
+
+CREATE FUNCTION intarr_to_int8_array(intarr)
+RETURNS int8[]
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
+
+CREATE FUNCTION intarr_to_int4_array(intarr)
+RETURNS int4[]
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 100;
+
+CREATE CAST (int8[] AS intarr) WITH FUNCTION intarr(int8[]);
+CREATE CAST (int4[] AS intarr) WITH FUNCTION intarr(int4[]);
+CREATE CAST (intarr AS int8[]) WITH FUNCTION intarr_to_int8_array(intarr);
+CREATE CAST (intarr AS int4[]) WITH FUNCTION intarr_to_int4_array(intarr);
+
+CREATE FUNCTION intarr_eq(intarr, intarr)
+RETURNS bool
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE FUNCTION intarr_ne(intarr, intarr)
+RETURNS bool
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE FUNCTION intarr_lt(intarr, intarr)
+RETURNS bool
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE FUNCTION intarr_le(intarr, intarr)
+RETURNS bool
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE FUNCTION intarr_gt(intarr, intarr)
+RETURNS bool
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE FUNCTION intarr_ge(intarr, intarr)
+RETURNS bool
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE FUNCTION intarr_cmp(intarr, intarr)
+RETURNS int4
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE FUNCTION intarr_hash(intarr)
+RETURNS int4
+AS 'pg_intmap'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE
+COST 10;
+
+CREATE OPERATOR = (
+    leftarg    = intarr,
+    rightarg   = intarr,
+    procedure  = intarr_eq,
+    commutator = =,
+    negator    = <>,
+    restrict   = eqsel,
+    join       = eqjoinsel,
+    hashes,
+    merges
+);
+
+CREATE OPERATOR <> (
+    leftarg    = intarr,
+    rightarg   = intarr,
+    procedure  = intarr_ne,
+    commutator = <>,
+    negator    = =,
+    restrict   = neqsel,
+    join       = neqjoinsel
+);
+
+CREATE OPERATOR < (
+    leftarg    = intarr,
+    rightarg   = intarr,
+    procedure  = intarr_lt,
+    commutator = >,
+    negator    = >=,
+    restrict   = scalarltsel,
+    join       = scalarltjoinsel
+);
+
+CREATE OPERATOR <= (
+    leftarg    = intarr,
+    rightarg   = intarr,
+    procedure  = intarr_le,
+    commutator = >=,
+    negator    = >,
+    restrict   = scalarlesel,
+    join       = scalarlejoinsel
+);
+
+CREATE OPERATOR > (
+    leftarg    = intarr,
+    rightarg   = intarr,
+    procedure  = intarr_gt,
+    commutator = <,
+    negator    = <=,
+    restrict   = scalargtsel,
+    join       = scalargtjoinsel
+);
+
+CREATE OPERATOR >= (
+    leftarg    = intarr,
+    rightarg   = intarr,
+    procedure  = intarr_ge,
+    commutator = <=,
+    negator    = <,
+    restrict   = scalargesel,
+    join       = scalargejoinsel
+);
+
+CREATE OPERATOR CLASS intarr_ops
+DEFAULT FOR TYPE intarr USING btree AS
+    OPERATOR 1 <,
+    OPERATOR 2 <=,
+    OPERATOR 3 =,
+    OPERATOR 4 >=,
+    OPERATOR 5 >,
+    FUNCTION 1 intarr_cmp(intarr, intarr);
+
+CREATE OPERATOR CLASS intarr_hash_ops
+DEFAULT FOR TYPE intarr USING hash AS
+    OPERATOR 1 =,
+    FUNCTION 1 intarr_hash(intarr);
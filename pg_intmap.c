@@ -1,29 +1,74 @@
 #include "postgres.h"
 #include "fmgr.h"
+#include "funcapi.h"
+#include "access/hash.h"
+#include "access/htup_details.h"
+#if PG_VERSION_NUM >= 130000
+#include "access/detoast.h"
+#else
+#include "access/tuptoaster.h"
+#endif
+#include "access/xact.h"
+#include "catalog/pg_statistic.h"
 #include "catalog/pg_type_d.h"
+#include "commands/vacuum.h"
 #include "lib/stringinfo.h"
+#include "utils/builtins.h"
 #include "utils/array.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/selfuncs.h"
+#include "utils/typcache.h"
 
 #include "encodings.h"
 
 
 PG_MODULE_MAGIC;
 
-#define INTMAP_VERSION      0
+void _PG_init(void);
+
+#define INTMAP_VERSION      1
 
 #define PLAIN_ENCODING      0
 #define VARINT_ENCODING     1
 #define BITPACK_ENCODING    2
 #define ZIGZAG_ENCODING     8
 
+/* intmap flags (since version 1) */
+#define INTMAP_FLAG_HASH    0x01    /* hash index over the keys */
+#define INTMAP_FLAG_BLOOM   0x02    /* bloom filter over the keys */
+#define INTMAP_FLAG_MULTI   0x04    /* several value columns */
+
+/* max number of value columns */
+#define INTMAP_MAX_COLUMNS  16
+
+/* number of values decoded at once by block-wise routines */
+#define DECODE_BLOCK_SIZE   256
+
+/* bloom filter parameters */
+#define BLOOM_BITS_PER_KEY  10
+#define BLOOM_NHASHES       4
+
+/*
+ * Max bytes occupied by intmap header (not including bloom filter itself):
+ * 40 bytes for the fixed part and up to 11 bytes for each additional column
+ */
+#define INTMAP_HEADER_MAX_SIZE  (40 + (INTMAP_MAX_COLUMNS - 1) * 11)
+
 
 typedef struct
 {
     uint64_t    nitems;
-    uint64_t    valoff;  /* values offset */
+    uint64_t    valoff[INTMAP_MAX_COLUMNS];  /* values offsets */
+    uint64_t    hashoff; /* hash index offset (INTMAP_FLAG_HASH only) */
+    uint64_t    bloom_size; /* bloom filter size in bytes */
+    uint8_t    *bloom;   /* bloom filter (INTMAP_FLAG_BLOOM only) */
     uint8_t     key_enc;
-    uint8_t     val_enc;
+    uint8_t     val_enc[INTMAP_MAX_COLUMNS];
+    uint8_t     ncols;   /* number of value columns */
     uint8_t     version;
+    uint8_t     flags;
 } IntMapHeader;
 
 typedef struct
@@ -44,28 +89,58 @@ typedef struct
  * properly inlined. But just in case this isn't the case (and for debugging
  * purposes)
  */
+uint64_t bitpack_mask(uint8_t num_bits);
+uint64_t bitpack_load(const uint8_t *buf, const uint8_t *end);
 uint8_t *varint_encode(uint8_t *buf, uint64_t val);
 uint8_t *varint_decode(uint8_t *buf, uint64_t *out);
 uint8_t *bitpack_encode(uint8_t *buf, const uint64_t *vals, uint32_t nvals, uint8_t num_bits);
 uint8_t *bitpack_decode(uint8_t *buf, uint64_t *out, uint32_t nvals, uint8_t num_bits);
 uint64_t zigzag_encode(int64_t value);
 int64_t zigzag_decode(uint64_t value);
-void bitpack_iter_init(BitpackIter *it, uint8_t *buf, uint8_t num_bits);
+void bitpack_iter_init(BitpackIter *it, uint8_t *buf, uint8_t num_bits,
+                       uint64_t nvals);
 uint64_t bitpack_iter_next(BitpackIter *it);
 uint8_t *bitpack_iter_finish(BitpackIter *it);
+uint64_t bitpack_get(const uint8_t *buf, uint64_t idx, uint8_t num_bits);
+void bitpack_set(uint8_t *buf, uint64_t idx, uint8_t num_bits, uint64_t val);
+uint64_t hash64(uint64_t x);
 
 /*
  * parse.c declarations
  */
-void parse_intmap(const char *c, int64_t **keys, int64_t **values, int *n);
+void parse_intmap(const char *c, int64_t **keys, int64_t **values, int *n,
+                  int *ncols);
 void parse_intarr(const char *c, int64_t **values, int *n);
 void intmap_qsort(int64_t *keys, int64_t *values, int32_t n);
+void intmap_sort(int64_t *keys, int64_t *values, int32_t n, int32_t ncols);
 
-static Datum create_intmap_internal(uint64_t *keys, uint64_t *values, uint32_t n);
-static Datum create_intarr_internal(uint64_t *values, uint32_t n);
+static Datum create_intmap_internal(const int64_t *keys, const int64_t *values,
+                                    uint32_t n, uint8_t ncols, uint8_t flags);
+static Datum create_intarr_internal(const int64_t *values, uint32_t n);
 
 
-static void collect_stats(ArrayStats *stats, int64_t *vals, uint32_t n)
+/*
+ * Number of bits sufficient to represent the value
+ */
+static inline uint8_t bits_required(uint64_t val)
+{
+    return val ? (sizeof(uint64_t) << 3) - __builtin_clzl(val) : 0;
+}
+
+/*
+ * Number of bytes required to encode the value using varint
+ */
+static inline uint8_t varint_len(uint64_t val)
+{
+    return val ? (bits_required(val) + 7 - 1) / 7 : 1;
+}
+
+/*
+ * collect_stats
+ *      Find out which encoding is the most compact for the values. Values
+ *      are left intact, zigzag is applied on the fly by encode_array().
+ */
+static void collect_stats(ArrayStats *stats, const int64_t *vals, uint32_t n)
 {
     uint64_t max = 0;
     uint64_t varint_size = 0;
@@ -78,17 +153,17 @@ static void collect_stats(ArrayStats *stats, int64_t *vals, uint32_t n)
 
     for (uint32_t i = 0; i < n; ++i) {
         /* encode with zigzag if needed */
-        vals[i] = stats->use_zigzag ? zigzag_encode(vals[i]) : (uint64_t) vals[i];
+        uint64_t val = stats->use_zigzag ? zigzag_encode(vals[i]) : (uint64_t) vals[i];
 
         /* count bytes needed for varint encoding */
-        varint_size += ((sizeof(int64_t) << 3) - __builtin_clzl(vals[i]) + 7 - 1) / 7;
+        varint_size += varint_len(val);
 
         /* find max */
-        max = max > (uint64_t) vals[i] ? max : (uint64_t) vals[i];
+        max = max > val ? max : val;
     }
 
     stats->varint_size= varint_size;
-    stats->num_bits = (sizeof(uint64_t) << 3) - __builtin_clzl(max);
+    stats->num_bits = bits_required(max);
 
     /* number of bits / 8 + 1 byte for bits length encoding */
     stats->bitpack_size = ((n * stats->num_bits + 7) >> 3) + 1;
@@ -111,6 +186,89 @@ static inline uint8_t *read_num_bits(uint8_t *buf, uint8_t *num_bits)
     return ++buf;
 }
 
+/*
+ * Force particular encoding regardless of which one is the most compact.
+ */
+static inline void stats_force_encoding(ArrayStats *stats, uint8_t encoding)
+{
+    stats->best_encoding = encoding;
+    stats->best_size = encoding == VARINT_ENCODING ?
+        stats->varint_size : stats->bitpack_size;
+}
+
+/*
+ * alloc_varlena
+ *      Allocate a varlena of exactly the given size.
+ *
+ * Nothing past the datum is needed: bit packed data is read (and patched)
+ * no further than its last byte, as datums read from disk end right there.
+ */
+static inline struct varlena *alloc_varlena(Size size)
+{
+    struct varlena *res = palloc(size);
+
+    SET_VARSIZE(res, size);
+
+    return res;
+}
+
+/*
+ * Scratch buffers
+ *
+ * Building a map needs temporary arrays: keys and values converted from
+ * int4[] or sorted, slots of the hash index. Instead of allocating them
+ * for every map, each kind of buffer is kept per backend and reused.
+ * Buffers grown beyond SCRATCH_KEEP_SIZE are released at the end of
+ * transaction, so that building a single huge map doesn't pin memory.
+ */
+#define SCRATCH_KEEP_SIZE   (1024 * 1024)
+
+typedef struct
+{
+    void       *data;
+    Size        size;
+} ScratchBuf;
+
+static MemoryContext scratch_context = NULL;
+static ScratchBuf scratch_keys;
+static ScratchBuf scratch_values;
+static ScratchBuf scratch_slots;
+
+/*
+ * scratch_get
+ *      Get the buffer of at least the given size. Contents are not
+ *      preserved when the buffer grows.
+ */
+static void *scratch_get(ScratchBuf *buf, Size size)
+{
+    if (buf->size >= size)
+        return buf->data;
+
+    if (!scratch_context)
+        scratch_context = AllocSetContextCreate(TopMemoryContext,
+                                                "intmap scratch",
+                                                ALLOCSET_DEFAULT_SIZES);
+    if (buf->data)
+        pfree(buf->data);
+    buf->data = NULL;
+    buf->size = 0;
+
+    size = Max(size, 1024);
+    buf->data = MemoryContextAlloc(scratch_context, size);
+    buf->size = size;
+
+    return buf->data;
+}
+
+static void scratch_trim(ScratchBuf *buf)
+{
+    if (buf->size > SCRATCH_KEEP_SIZE) {
+        pfree(buf->data);
+        buf->data = NULL;
+        buf->size = 0;
+    }
+}
+
 /*
  * intmap_read_header
  *      Decode intmap header.
@@ -124,7 +282,18 @@ static inline uint8_t *read_num_bits(uint8_t *buf, uint8_t *num_bits)
  *    > 3 bits:  keys encoding (one of *_ENCODING values);
  *    > 1 bit:   ziazag encoding for values (true/false);
  *    > 3 bits:  values encoding;
- * - values offset encoded using varint
+ * - flags (8 bits, version 1 and later): combination of INTMAP_FLAG_* values;
+ * - values offset encoded using varint;
+ * - hash index offset encoded using varint (INTMAP_FLAG_HASH only);
+ * - number of value columns (1 byte) followed by encoding (1 byte) and
+ *   varint encoded offset of each column but the first one
+ *   (INTMAP_FLAG_MULTI only);
+ * - bloom filter size in bytes encoded using varint followed by the filter
+ *   itself (INTMAP_FLAG_BLOOM only).
+ *
+ * All offsets are relative to the beginning of the keys section, which
+ * immediately follows the header. Value columns follow the keys in order,
+ * hash index follows the last value column.
  */
 static inline uint8_t *intmap_read_header(uint8_t *buf, IntMapHeader *h)
 {
@@ -141,10 +310,39 @@ static inline uint8_t *intmap_read_header(uint8_t *buf, IntMapHeader *h)
 
     /* read encodings */
     h->key_enc = *buf >> 4;
-    h->val_enc = *buf++ & 0x0f;
+    h->val_enc[0] = *buf++ & 0x0f;
+
+    /* read flags; version 0 maps don't have any */
+    h->flags = h->version > 0 ? *buf++ : 0;
 
     /* read values offset */
-    buf = varint_decode(buf, &h->valoff);
+    buf = varint_decode(buf, &h->valoff[0]);
+
+    /* read hash index offset */
+    if (h->flags & INTMAP_FLAG_HASH)
+        buf = varint_decode(buf, &h->hashoff);
+
+    /* read additional value columns */
+    h->ncols = 1;
+    if (h->flags & INTMAP_FLAG_MULTI) {
+        h->ncols = *buf++;
+        if (h->ncols > INTMAP_MAX_COLUMNS)
+            elog(ERROR, "invalid number of intmap columns: %u", h->ncols);
+
+        for (uint8_t i = 1; i < h->ncols; ++i) {
+            h->val_enc[i] = *buf++;
+            buf = varint_decode(buf, &h->valoff[i]);
+        }
+    }
+
+    /* read bloom filter */
+    h->bloom_size = 0;
+    h->bloom = NULL;
+    if (h->flags & INTMAP_FLAG_BLOOM) {
+        buf = varint_decode(buf, &h->bloom_size);
+        h->bloom = buf;
+        buf += h->bloom_size;
+    }
 
     return buf;
 }
@@ -173,28 +371,100 @@ static inline uint8_t *intmap_write_header(uint8_t *buf, IntMapHeader *h)
         *buf++ |= n;
 
     /* write encodings */
-    *buf++ = h->key_enc << 4 | (h->val_enc & 0xF);
+    *buf++ = h->key_enc << 4 | (h->val_enc[0] & 0xF);
+
+    /* write flags */
+    *buf++ = h->flags;
 
     /* write values offset */
-    buf = varint_encode(buf, h->valoff);
+    buf = varint_encode(buf, h->valoff[0]);
+
+    /* write hash index offset */
+    if (h->flags & INTMAP_FLAG_HASH)
+        buf = varint_encode(buf, h->hashoff);
+
+    /* write additional value columns */
+    if (h->flags & INTMAP_FLAG_MULTI) {
+        *buf++ = h->ncols;
+        for (uint8_t i = 1; i < h->ncols; ++i) {
+            *buf++ = h->val_enc[i];
+            buf = varint_encode(buf, h->valoff[i]);
+        }
+    }
+
+    /* reserve space for bloom filter, it is filled in by bloom_add() */
+    if (h->flags & INTMAP_FLAG_BLOOM) {
+        buf = varint_encode(buf, h->bloom_size);
+        h->bloom = buf;
+        memset(buf, 0, h->bloom_size);
+        buf += h->bloom_size;
+    }
 
     return buf;
 }
 
 /*
- * values are expected to be already zigzaged if needed.
+ * intmap_header_size
+ *      Number of bytes intmap_write_header() would write.
+ */
+static inline uint64_t intmap_header_size(IntMapHeader *h)
+{
+    uint64_t size = 1 + 1 + 1;  /* version and nitems, encodings, flags */
+
+    if (h->nitems > 0x0f)
+        size += varint_len(h->nitems >> 4);
+    size += varint_len(h->valoff[0]);
+    if (h->flags & INTMAP_FLAG_HASH)
+        size += varint_len(h->hashoff);
+    if (h->flags & INTMAP_FLAG_MULTI) {
+        size += 1;
+        for (uint8_t i = 1; i < h->ncols; ++i)
+            size += 1 + varint_len(h->valoff[i]);
+    }
+    if (h->flags & INTMAP_FLAG_BLOOM)
+        size += varint_len(h->bloom_size) + h->bloom_size;
+
+    return size;
+}
+
+/*
+ * encode_array
+ *      Encode values using the encoding chosen by collect_stats(). Writes
+ *      exactly stats->best_size bytes.
  */
 static inline uint8_t *encode_array(uint8_t *buf, ArrayStats *stats,
-                                    int64_t *vals, uint32_t n)
+                                    const int64_t *vals, uint32_t n)
 {
     switch (stats->best_encoding) {
         case VARINT_ENCODING:
-            for (uint32_t i = 0; i < n; ++i)
-                buf = varint_encode(buf, vals[i]);
+            if (stats->use_zigzag)
+                for (uint32_t i = 0; i < n; ++i)
+                    buf = varint_encode(buf, zigzag_encode(vals[i]));
+            else
+                for (uint32_t i = 0; i < n; ++i)
+                    buf = varint_encode(buf, vals[i]);
             break;
         case BITPACK_ENCODING:
             buf = write_num_bits(buf, stats->num_bits);
-            buf = bitpack_encode(buf, vals, n, stats->num_bits);
+            if (!stats->use_zigzag) {
+                buf = bitpack_encode(buf, (const uint64_t *) vals, n,
+                                     stats->num_bits);
+                break;
+            }
+
+            /*
+             * Zigzag values block by block. A block of DECODE_BLOCK_SIZE
+             * values always takes whole 64 bit words, so blocks can be
+             * packed independently.
+             */
+            for (uint32_t i = 0; i < n; i += DECODE_BLOCK_SIZE) {
+                uint64_t    block[DECODE_BLOCK_SIZE];
+                uint32_t    cnt = Min(DECODE_BLOCK_SIZE, n - i);
+
+                for (uint32_t j = 0; j < cnt; ++j)
+                    block[j] = zigzag_encode(vals[i + j]);
+                buf = bitpack_encode(buf, block, cnt, stats->num_bits);
+            }
             break;
         default:
             elog(ERROR, "unexpected encoding");
@@ -204,20 +474,20 @@ static inline uint8_t *encode_array(uint8_t *buf, ArrayStats *stats,
 }
 
 static inline uint8_t *decode_array(uint8_t *buf, uint8_t encoding,
-                                    uint64_t *vals, uint32_t n)
+                                    int64_t *vals, uint32_t n)
 {
     switch (encoding & 0x7)
     {
         case VARINT_ENCODING:
             for (uint32_t i = 0; i < n; ++i)
-                buf = varint_decode(buf, &vals[i]);
+                buf = varint_decode(buf, (uint64_t *) &vals[i]);
             break;
         case BITPACK_ENCODING:
             {
                 uint8_t num_bits;
 
                 buf = read_num_bits(buf, &num_bits);
-                buf = bitpack_decode(buf, vals, n, num_bits);
+                buf = bitpack_decode(buf, (uint64_t *) vals, n, num_bits);
                 break;
             }
         default:
@@ -226,7 +496,7 @@ static inline uint8_t *decode_array(uint8_t *buf, uint8_t encoding,
 
     if (encoding & ZIGZAG_ENCODING)
         for (uint32_t i = 0; i < n; ++i)
-            vals[i] = zigzag_decode(vals[i]);
+            vals[i] = zigzag_decode((uint64_t) vals[i]);
 
     return buf;
 }
@@ -246,7 +516,13 @@ typedef struct {
     } u;
 } DecoderIter;
 
-static inline void decoder_iter_init(DecoderIter *it, uint8_t encoding, uint8_t *buf)
+/*
+ * decoder_iter_init
+ *      Start decoding n values at buf. The number of values bounds how far
+ *      bit packed data may be read.
+ */
+static inline void decoder_iter_init(DecoderIter *it, uint8_t encoding,
+                                     uint8_t *buf, uint64_t n)
 {
     it->encoding = encoding & 0x7;
     it->zigzag = encoding & 0x8;
@@ -261,7 +537,7 @@ static inline void decoder_iter_init(DecoderIter *it, uint8_t encoding, uint8_t
                 uint8_t     num_bits;
 
                 buf = read_num_bits(buf, &num_bits);
-                bitpack_iter_init(&it->u.bitpack, buf, num_bits);
+                bitpack_iter_init(&it->u.bitpack, buf, num_bits, n);
                 break;
             }
         default:
@@ -304,211 +580,1885 @@ static inline uint8_t *decoder_iter_finish(DecoderIter *it)
     }
 }
 
-PG_FUNCTION_INFO_V1(intmap_in);
-Datum intmap_in(PG_FUNCTION_ARGS)
+/*
+ * decoder_iter_skip
+ *      Skip n values. Bit packed values are skipped without decoding them.
+ */
+static inline void decoder_iter_skip(DecoderIter *it, uint64_t n)
 {
-    char    *in = PG_GETARG_CSTRING(0);
-    int64_t *keys;
-    int64_t *values;
-    int      n;
+    switch (it->encoding)
+    {
+        case VARINT_ENCODING:
+            {
+                uint64_t tmp;
 
-    parse_intmap(in, &keys, &values, &n);
+                for (uint64_t i = 0; i < n; ++i)
+                    it->u.varint.buf = varint_decode(it->u.varint.buf, &tmp);
+                break;
+            }
+        case BITPACK_ENCODING:
+            {
+                BitpackIter *bp = &it->u.bitpack;
+                uint64_t     bits = bp->bits_read + n * bp->num_bits;
 
-    return create_intmap_internal(keys, values, n);
+                bp->buf += (bits / INT64_BITSIZE) * sizeof(uint64_t);
+                bp->bits_read = bits & (INT64_BITSIZE - 1);
+                bp->reg = bitpack_load(bp->buf, bp->end);
+                bp->reg >>= bp->bits_read;
+                break;
+            }
+        default:
+            elog(ERROR, "unsupported encoding");
+    }
 }
 
-PG_FUNCTION_INFO_V1(intmap_out);
-Datum intmap_out(PG_FUNCTION_ARGS)
+/*
+ * decoder_iter_next_block
+ *      Decode next n values into the buffer.
+ */
+static inline void decoder_iter_next_block(DecoderIter *it, int64_t *out,
+                                           uint32_t n)
 {
-    Datum        in = PointerGetDatum(PG_DETOAST_DATUM(PG_GETARG_DATUM(0)));
-    uint8_t     *data = VARDATA(in);
-    IntMapHeader h;
-    DecoderIter  k_it, v_it;
-    StringInfoData str;
+    for (uint32_t i = 0; i < n; ++i)
+        out[i] = decoder_iter_next(it);
+}
 
-    data = intmap_read_header(data, &h);
+/*
+ * Number of slots in hash index for n items. Always a power of two and
+ * always larger than n so that there is at least one empty slot to
+ * terminate probing.
+ */
+static inline uint64_t hash_index_slots(uint64_t n)
+{
+    uint64_t slots = 1;
 
-    /* iterate through keys/values */
-    decoder_iter_init(&k_it, h.key_enc, data);
-    decoder_iter_init(&v_it, h.val_enc, data + h.valoff);
-    initStringInfo(&str);
-    for (uint32_t i = 0; i < h.nitems; ++i) {
-        appendStringInfo(&str, i == 0 ? "%ld=>%ld" : ", %ld=>%ld",
-                         decoder_iter_next(&k_it),
-                         decoder_iter_next(&v_it));
-    }
+    while (slots <= n + n / 3)
+        slots <<= 1;
 
-    PG_RETURN_CSTRING(str.data);
+    return slots;
 }
 
-static Datum create_intmap_internal(uint64_t *keys, uint64_t *values, uint32_t n)
+/*
+ * hash_index_encode
+ *      Build and write open addressing hash index over the keys.
+ *
+ * Each slot holds either 0 (empty) or the position of the key in the keys
+ * section plus one. Collisions are resolved with linear probing. Index
+ * structure:
+ * - log2 of the number of slots (1 byte);
+ * - slots encoded using bit packing.
+ */
+static uint8_t *hash_index_encode(uint8_t *buf, const int64_t *keys, uint32_t n)
 {
-    uint8_t    *out;
-    uint8_t    *data;
-    ArrayStats key_stats, val_stats;
-    uint8_t    *keys_start;
-    IntMapHeader h;
+    uint64_t    nslots = hash_index_slots(n);
+    uint64_t    mask = nslots - 1;
+    uint64_t   *slots = scratch_get(&scratch_slots, sizeof(uint64_t) * nslots);
+    uint8_t     num_bits = bits_required(n);
 
-    /* TODO: estimate size */
-    out = palloc0(VARHDRSZ + 5 + sizeof(uint64_t) * n * 2);
-    data = VARDATA(out);
+    memset(slots, 0, sizeof(uint64_t) * nslots);
 
-    collect_stats(&key_stats, keys, n);
-    collect_stats(&val_stats, values, n);
+    for (uint32_t i = 0; i < n; ++i) {
+        uint64_t pos = hash64(keys[i]) & mask;
 
-    /* Write header */
-    h.version = INTMAP_VERSION;
-    h.nitems  = n;
-    h.key_enc = key_stats.best_encoding | (key_stats.use_zigzag ? ZIGZAG_ENCODING : 0);
-    h.val_enc = val_stats.best_encoding | (val_stats.use_zigzag ? ZIGZAG_ENCODING : 0);
-    h.valoff = key_stats.best_size;
-    keys_start = data = intmap_write_header(data, &h);
+        while (slots[pos] != 0)
+            pos = (pos + 1) & mask;
+        slots[pos] = i + 1;
+    }
 
-    /* Encode keys and values */
-    data = encode_array(data, &key_stats, keys, n);
-    Assert(data == keys_start + key_stats.best_size);
-    data = encode_array(data, &val_stats, values, n);
+    *buf++ = bits_required(mask);
+    buf = write_num_bits(buf, num_bits);
+    buf = bitpack_encode(buf, slots, nslots, num_bits);
 
-    SET_VARSIZE(out, data - out);
-    return PointerGetDatum(out);
+    return buf;
 }
 
+/*
+ * Hash index size in bytes
+ */
+static inline uint64_t hash_index_size(uint32_t n)
+{
+    return 2 + ((hash_index_slots(n) * bits_required(n) + 7) >> 3);
+}
 
-PG_FUNCTION_INFO_V1(create_intmap);
-Datum create_intmap(PG_FUNCTION_ARGS)
+/*
+ * hash_index_find
+ *      Find the position of the key using hash index. Returns -1 if the key
+ *      is not found.
+ *
+ * Keys and values of hash layout intmap are always bit packed, so that
+ * both can be accessed directly by position.
+ */
+static int64_t hash_index_find(uint8_t *data, IntMapHeader *h, int64_t key)
 {
-    ArrayType  *keys_arr = PG_GETARG_ARRAYTYPE_P(0);
-    ArrayType  *values_arr = PG_GETARG_ARRAYTYPE_P(1);
-    uint64_t   *keys, *values;
-    uint32_t    nkeys, nvalues;
-    bool       *null_keys, *null_values;
+    uint8_t    *index = data + h->hashoff;
+    uint8_t    *keys = data;
+    uint8_t     key_bits, slot_bits;
+    uint64_t    mask;
+    uint64_t    pos;
 
-    deconstruct_array(keys_arr, INT8OID, sizeof(int64_t), true, 'd',
-                      &keys, &null_keys, &nkeys);
+    mask = ~((uint64_t)-1 << *index++);
+    index = read_num_bits(index, &slot_bits);
+    keys = read_num_bits(keys, &key_bits);
 
-    deconstruct_array(values_arr, INT8OID, sizeof(int64_t), true, 'd',
-                      &values, &null_values, &nvalues);
+    pos = hash64(key) & mask;
+    while (true) {
+        uint64_t slot = bitpack_get(index, pos, slot_bits);
+        int64_t  k;
 
-    if (nkeys != nvalues)
-        elog(ERROR, "the keys array size does not match the values array size");
+        if (slot == 0)
+            return -1;
 
-    for (uint32_t i = 0; i < nkeys; ++i)
-        if (null_keys[i] | null_values[i])
-            elog(ERROR, "input arrays must not contain NULLs");
+        k = bitpack_get(keys, slot - 1, key_bits);
+        if (h->key_enc & ZIGZAG_ENCODING)
+            k = zigzag_decode(k);
 
-    intmap_qsort(keys, values, nkeys);
+        if (k == key)
+            return slot - 1;
 
-    return create_intmap_internal(keys, values, nkeys);
+        pos = (pos + 1) & mask;
+    }
 }
 
-
-PG_FUNCTION_INFO_V1(intmap_get_val);
-Datum intmap_get_val(PG_FUNCTION_ARGS)
+/*
+ * intmap_find
+ *      Find the position of the key within the map. Returns -1 if the key is
+ *      not found.
+ */
+static int64_t intmap_find(uint8_t *data, IntMapHeader *h, int64_t key)
 {
-    Datum        in = PointerGetDatum(PG_DETOAST_DATUM(PG_GETARG_DATUM(0)));
-    uint64_t     key = DatumGetUInt64(PG_GETARG_DATUM(1));
-    uint8_t     *data = VARDATA(in);
-    IntMapHeader h;
-    DecoderIter  k_it, v_it;
+    DecoderIter it;
 
-    /* read header */
-    data = intmap_read_header(data, &h);
+    if (h->flags & INTMAP_FLAG_HASH)
+        return hash_index_find(data, h, key);
 
-    /* read keys */
-    decoder_iter_init(&k_it, h.key_enc, data);
-    decoder_iter_init(&v_it, h.val_enc, data + h.valoff);
-    for (uint32_t i = 0; i < h.nitems; ++i) {
-        int64_t val = decoder_iter_next(&v_it);
+    /* keys are sorted, so stop as soon as we've passed the key */
+    decoder_iter_init(&it, h->key_enc, data, h->nitems);
+    for (uint32_t i = 0; i < h->nitems; ++i) {
+        int64_t k = decoder_iter_next(&it);
 
-        if (decoder_iter_next(&k_it) == key)
-            PG_RETURN_INT64(val);
+        if (k == key)
+            return i;
+        if (k > key)
+            break;
     }
 
-    /* key's not found */
-    PG_RETURN_NULL();
+    return -1;
 }
 
-static inline const char *encoding_to_str(uint8_t encoding)
+/*
+ * intmap_lower_bound
+ *      Find the position of the first key greater than or equal to the given
+ *      one. Bit packed keys are binary searched.
+ */
+static uint64_t intmap_lower_bound(uint8_t *data, IntMapHeader *h, int64_t key)
 {
-    switch (encoding) {
-        case VARINT_ENCODING:
-            return "varint";
-        case BITPACK_ENCODING:
-            return "bit-pack";
-        case VARINT_ENCODING | ZIGZAG_ENCODING:
-            return "varint (zig-zag)";
-        case BITPACK_ENCODING | ZIGZAG_ENCODING:
-            return "bit-pack (zig-zag)";
-        default:
-            elog(ERROR, "unexpected encoding");
+    uint64_t    lo = 0,
+                hi = h->nitems;
+
+    if ((h->key_enc & 0x7) == BITPACK_ENCODING) {
+        uint8_t num_bits;
+
+        data = read_num_bits(data, &num_bits);
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            int64_t  k = bitpack_get(data, mid, num_bits);
+
+            if (h->key_enc & ZIGZAG_ENCODING)
+                k = zigzag_decode(k);
+
+            if (k < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+    } else {
+        DecoderIter it;
+
+        decoder_iter_init(&it, h->key_enc, data, h->nitems);
+        while (lo < hi && decoder_iter_next(&it) < key)
+            lo++;
     }
+
+    return lo;
 }
 
-PG_FUNCTION_INFO_V1(intmap_meta);
-Datum intmap_meta(PG_FUNCTION_ARGS)
+/*
+ * intmap_value_at
+ *      Decode value of the given column at the given position.
+ */
+static inline int64_t intmap_value_at(uint8_t *data, IntMapHeader *h,
+                                      uint8_t col, uint64_t pos)
 {
-    Datum in = PointerGetDatum(PG_DETOAST_DATUM(PG_GETARG_DATUM(0)));
-    uint8_t *data = VARDATA(in);
-    IntMapHeader h;
-    StringInfoData str;
-
-    /* read header */
-    data = intmap_read_header(data, &h);
+    DecoderIter it;
 
-    initStringInfo(&str);
-    appendStringInfo(&str, "ver: %u, num: %u, keys encoding: %s, values encoding: %s",
-                     h.version,
-                     h.nitems,
-                     encoding_to_str(h.key_enc),
-                     encoding_to_str(h.val_enc));
+    decoder_iter_init(&it, h->val_enc[col], data + h->valoff[col], h->nitems);
+    decoder_iter_skip(&it, pos);
 
-    PG_RETURN_CSTRING(str.data);
+    return decoder_iter_next(&it);
 }
 
-PG_FUNCTION_INFO_V1(intarr_in);
-Datum intarr_in(PG_FUNCTION_ARGS)
+/*
+ * intmap_patch_value
+ *      Overwrite the value at the given position in place. Only possible if
+ *      the new value occupies exactly as much space as the old one, returns
+ *      false otherwise.
+ *
+ * The patch is also refused if the column would no longer be encoded the way
+ * create_intmap_internal() encodes it, so that the encoding stays canonical.
+ * Without scanning the column this is only certain if the new value requires
+ * as many bits as the old one (hence the max number of bits, which drives the
+ * choice of encoding, doesn't change), or if neither of them is the widest
+ * bit packed value and the varint size of the column doesn't shrink. Also,
+ * the last negative value can't be replaced, as zigzag encoding would not be
+ * needed any more.
+ */
+static bool intmap_patch_value(uint8_t *data, IntMapHeader *h, uint8_t col,
+                               uint64_t pos, int64_t val)
 {
-    char    *in = PG_GETARG_CSTRING(0);
-    int64_t *values;
-    int      n;
+    uint8_t    *buf = data + h->valoff[col];
+    uint8_t     encoding = h->val_enc[col];
+    uint64_t    enc;
 
-    parse_intarr(in, &values, &n);
+    if (encoding & ZIGZAG_ENCODING)
+        enc = zigzag_encode(val);
+    else if (val < 0)
+        return false;
+    else
+        enc = val;
 
-    return create_intarr_internal(values, n);
+    switch (encoding & 0x7)
+    {
+        case VARINT_ENCODING:
+            {
+                uint64_t    old;
+
+                for (uint64_t i = 0; i < pos; ++i)
+                    buf = varint_decode(buf, &old);
+                varint_decode(buf, &old);
+
+                /* also guarantees the same varint length */
+                if (bits_required(enc) != bits_required(old))
+                    return false;
+                if ((encoding & ZIGZAG_ENCODING) && (old & 1) && val >= 0)
+                    return false;
+                varint_encode(buf, enc);
+                return true;
+            }
+        case BITPACK_ENCODING:
+            {
+                uint8_t     num_bits;
+                uint64_t    old;
+
+                buf = read_num_bits(buf, &num_bits);
+                old = bitpack_get(buf, pos, num_bits);
+
+                if (bits_required(enc) > num_bits)
+                    return false;
+                if (bits_required(old) == num_bits &&
+                    bits_required(enc) != num_bits)
+                    return false;
+                /* varint might become more compact (unless it's forced) */
+                if (!(h->flags & INTMAP_FLAG_HASH) &&
+                    varint_len(enc) < varint_len(old))
+                    return false;
+                if ((encoding & ZIGZAG_ENCODING) && (old & 1) && val >= 0)
+                    return false;
+                bitpack_set(buf, pos, num_bits, enc);
+                return true;
+            }
+        default:
+            elog(ERROR, "unsupported encoding");
+    }
 }
 
-static Datum create_intarr_internal(uint64_t *values, uint32_t n)
+/*
+ * intmap_decode
+ *      Decode all keys and values. Values are stored column by column, so the
+ *      values array must be large enough to hold h->nitems * h->ncols
+ *      elements.
+ */
+static void intmap_decode(uint8_t *data, IntMapHeader *h, int64_t *keys,
+                          int64_t *values)
 {
-    uint8_t    *out;
-    uint8_t    *data;
-    ArrayStats  stats;
+    decode_array(data, h->key_enc, keys, h->nitems);
+    for (uint8_t i = 0; i < h->ncols; ++i)
+        decode_array(data + h->valoff[i], h->val_enc[i],
+                     values + i * h->nitems, h->nitems);
+}
 
-    collect_stats(&stats, values, n);
+/*
+ * Bloom filter size in bytes for n items
+ */
+static inline uint64_t bloom_size(uint64_t n)
+{
+    return (n * BLOOM_BITS_PER_KEY + 7) >> 3;
+}
 
-    /*
-     * Size estimation includes:
-     * - bytea header (4 bytes)
-     * - version + encoding (1 byte)
-     * - varint encoded number of items (max 5 bytes)
-     * - calculated size of encoded data
-     */
-    out = palloc0(MAXALIGN(VARHDRSZ + 1 + 5 + stats.best_size));
-    data = VARDATA(out);
+/*
+ * Bloom filter bit positions are derived from a single 64 bit hash using
+ * double hashing: h1 + i * h2.
+ */
+static inline void bloom_add(uint8_t *bloom, uint64_t size, int64_t key)
+{
+    uint64_t h = hash64(key);
+    uint32_t h1 = (uint32_t) h;
+    uint32_t h2 = (uint32_t) (h >> 32) | 1;
+    uint64_t nbits = size << 3;
 
-    /*
-     * write the encoding
-     * TODO: write version into the same byte as well
-     */
-    *data++ = stats.best_encoding | (stats.use_zigzag ? ZIGZAG_ENCODING : 0);
+    for (uint32_t i = 0; i < BLOOM_NHASHES; ++i) {
+        uint64_t bit = (h1 + (uint64_t) i * h2) % nbits;
 
-    /* write the number of values */
-    data = varint_encode(data, n);
+        bloom[bit >> 3] |= 1 << (bit & 7);
+    }
+}
 
-    /* encode values */
-    data = encode_array(data, &stats, values, n);
+static inline bool bloom_may_contain(const uint8_t *bloom, uint64_t size,
+                                     int64_t key)
+{
+    uint64_t h = hash64(key);
+    uint32_t h1 = (uint32_t) h;
+    uint32_t h2 = (uint32_t) (h >> 32) | 1;
+    uint64_t nbits = size << 3;
 
-    SET_VARSIZE(out, data - out);
-    return PointerGetDatum(out);
+    /* empty map */
+    if (size == 0)
+        return false;
+
+    for (uint32_t i = 0; i < BLOOM_NHASHES; ++i) {
+        uint64_t bit = (h1 + (uint64_t) i * h2) % nbits;
+
+        if (!(bloom[bit >> 3] & (1 << (bit & 7))))
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * intmap_slice_is_cheap
+ *      Whether fetching the header of a toasted intmap costs less than
+ *      detoasting all of it.
+ *
+ * That's only the case for maps stored out of line and larger than the
+ * header slice; inline compressed maps are in memory already. Before PG 13
+ * a slice of a compressed external value is cut from the fully detoasted
+ * value, so only uncompressed ones qualify there.
+ */
+static bool intmap_slice_is_cheap(Pointer in)
+{
+    struct varatt_external toast_ptr;
+
+    if (!VARATT_IS_EXTERNAL_ONDISK(in))
+        return false;
+
+    VARATT_EXTERNAL_GET_POINTER(toast_ptr, in);
+#if PG_VERSION_NUM < 130000
+    if (VARATT_EXTERNAL_IS_COMPRESSED(toast_ptr))
+        return false;
+#endif
+
+    return toast_ptr.va_rawsize - VARHDRSZ > INTMAP_HEADER_MAX_SIZE;
+}
+
+/*
+ * intmap_toasted_may_contain
+ *      Check the key against the bloom filter of a toasted intmap.
+ *
+ * Only the header part of the datum is fetched (and decompressed), so that
+ * absent keys are ruled out without detoasting the whole map. Returns true
+ * if the key may be present or the map doesn't have a bloom filter.
+ */
+static bool intmap_toasted_may_contain(Datum datum, int64_t key)
+{
+    struct varlena *slice;
+    uint8_t        *data;
+    IntMapHeader    h;
+    uint64_t        header_size = 0;
+
+    slice = PG_DETOAST_DATUM_SLICE(datum, 0, INTMAP_HEADER_MAX_SIZE);
+    data = (uint8_t *) VARDATA(slice);
+
+    /* read bloom filter size without reading the filter itself */
+    h.flags = 0;
+    if (VARSIZE(slice) > VARHDRSZ)
+        header_size = intmap_read_header(data, &h) - data;
+    if (!(h.flags & INTMAP_FLAG_BLOOM))
+        return true;
+
+    /* fetch the rest of the filter if needed */
+    if (header_size > VARSIZE(slice) - VARHDRSZ) {
+        pfree(slice);
+        slice = PG_DETOAST_DATUM_SLICE(datum, 0, header_size);
+        data = (uint8_t *) VARDATA(slice);
+        intmap_read_header(data, &h);
+    }
+
+    return bloom_may_contain(h.bloom, h.bloom_size, key);
+}
+
+/*
+ * Lookup cache
+ *
+ * Queries like "SELECT m->1, m->2, ..., m->40 FROM t" look up many keys in
+ * the same map. Each lookup is a separate function call, so to avoid
+ * detoasting and scanning the map over and over again the last map is
+ * remembered per backend. When it's accessed for the second time, it is
+ * detoasted and cached: sorted maps are decoded and then binary searched,
+ * hash layout maps are kept as is.
+ *
+ * Toasted maps are identified by the toast pointer. Remembering an inline
+ * map must be cheap, as most often every row holds a different map looked
+ * up once, so only its size and a hash of its first and last bytes are kept.
+ * A fingerprint match merely makes the map being looked up cached; after
+ * that the raw bytes are compared in full. Toast value ids may be reused
+ * after the value is vacuumed away, so the cache is reset at the end of each
+ * transaction.
+ */
+typedef struct
+{
+    MemoryContext   mcxt;
+    bool            valid;      /* a map is remembered */
+    bool            external;   /* identified by toast pointer */
+    struct varatt_external toast_ptr;
+    Size            size;       /* fingerprint of an inline map */
+    uint64_t        hash;
+    bool            cached;     /* accessed again, map is cached */
+    struct varlena *raw;        /* raw bytes of a cached inline map */
+    struct varlena *map;        /* copy of a hash layout map */
+    IntMapHeader    h;
+    uint8_t        *data;       /* keys section of the map */
+    int64_t        *keys;       /* decoded keys and values, sorted layout */
+    int64_t        *values;
+} IntMapCache;
+
+/* bytes at each end of an inline map hashed into its fingerprint */
+#define CACHE_FINGERPRINT_BYTES 64
+
+static IntMapCache lookup_cache;
+
+/*
+ * Reference to a map to get values from, either directly or from the cache
+ */
+typedef struct
+{
+    IntMapHeader    h;
+    uint8_t        *data;       /* keys section of the detoasted map */
+    int64_t        *values;     /* decoded values (column by column) or NULL */
+} IntMapRef;
+
+static void intmap_cache_reset(void)
+{
+    lookup_cache.valid = false;
+    lookup_cache.cached = false;
+    lookup_cache.map = NULL;
+    lookup_cache.raw = NULL;
+    lookup_cache.keys = NULL;
+    lookup_cache.values = NULL;
+    if (lookup_cache.mcxt)
+        MemoryContextReset(lookup_cache.mcxt);
+}
+
+static void intmap_xact_callback(XactEvent event, void *arg)
+{
+    intmap_cache_reset();
+
+    scratch_trim(&scratch_keys);
+    scratch_trim(&scratch_values);
+    scratch_trim(&scratch_slots);
+}
+
+void _PG_init(void)
+{
+    RegisterXactCallback(intmap_xact_callback, NULL);
+}
+
+static uint64_t intmap_fingerprint(Pointer in, Size size)
+{
+    Size        n = Min(size, CACHE_FINGERPRINT_BYTES);
+    uint64_t    head, tail;
+
+    head = DatumGetUInt32(hash_any((unsigned char *) in, n));
+    tail = DatumGetUInt32(hash_any((unsigned char *) in + size - n, n));
+
+    return head << 32 | tail;
+}
+
+/*
+ * intmap_cache_get
+ *      Get the cached map if the datum is the same map as the last one.
+ *      Otherwise remember the datum and return NULL.
+ */
+static IntMapCache *intmap_cache_get(Datum datum)
+{
+    Pointer     in = DatumGetPointer(datum);
+    IntMapCache *c = &lookup_cache;
+    struct varatt_external toast_ptr;
+    MemoryContext old_context;
+    struct varlena *map;
+    uint8_t    *data;
+    Size        size = 0;
+    uint64_t    hash = 0;
+
+    /* in-memory external datums can't be identified */
+    if (VARATT_IS_EXTERNAL(in) && !VARATT_IS_EXTERNAL_ONDISK(in))
+        return NULL;
+
+    if (VARATT_IS_EXTERNAL_ONDISK(in)) {
+        VARATT_EXTERNAL_GET_POINTER(toast_ptr, in);
+        if (c->valid && c->external &&
+            c->toast_ptr.va_valueid == toast_ptr.va_valueid &&
+            c->toast_ptr.va_toastrelid == toast_ptr.va_toastrelid)
+            goto found;
+    } else {
+        size = VARSIZE_ANY(in);
+        if (c->valid && !c->external && c->cached &&
+            size == VARSIZE_ANY(c->raw) && memcmp(in, c->raw, size) == 0)
+            return c;
+
+        hash = intmap_fingerprint(in, size);
+        if (c->valid && !c->external && !c->cached &&
+            size == c->size && hash == c->hash)
+            goto found;
+    }
+
+    /* remember the new map */
+    intmap_cache_reset();
+    if (VARATT_IS_EXTERNAL_ONDISK(in)) {
+        c->external = true;
+        c->toast_ptr = toast_ptr;
+    } else {
+        c->external = false;
+        c->size = size;
+        c->hash = hash;
+    }
+    c->valid = true;
+
+    return NULL;
+
+found:
+    if (c->cached)
+        return c;
+
+    /* second access to the same map, cache it */
+    if (!c->mcxt)
+        c->mcxt = AllocSetContextCreate(TopMemoryContext,
+                                        "intmap lookup cache",
+                                        ALLOCSET_DEFAULT_SIZES);
+
+    map = PG_DETOAST_DATUM(datum);
+    data = intmap_read_header((uint8_t *) VARDATA(map), &c->h);
+
+    old_context = MemoryContextSwitchTo(c->mcxt);
+    if (!c->external) {
+        c->raw = palloc(size);
+        memcpy(c->raw, in, size);
+    }
+    if (c->h.flags & INTMAP_FLAG_HASH) {
+        c->map = alloc_varlena(VARSIZE(map));
+        memcpy(c->map, map, VARSIZE(map));
+        c->data = intmap_read_header((uint8_t *) VARDATA(c->map), &c->h);
+    } else {
+        c->keys = palloc(sizeof(int64_t) * (c->h.nitems * (c->h.ncols + 1) + 1));
+        c->values = c->keys + c->h.nitems;
+        intmap_decode(data, &c->h, c->keys, c->values);
+        c->data = NULL;
+        /* the bloom filter stays behind in the detoasted map */
+        c->h.flags &= ~INTMAP_FLAG_BLOOM;
+        c->h.bloom = NULL;
+    }
+    MemoryContextSwitchTo(old_context);
+    c->cached = true;
+
+    return c;
+}
+
+/*
+ * intmap_cache_find
+ *      Find the position of the key in the cached map.
+ */
+static int64_t intmap_cache_find(IntMapCache *c, int64_t key)
+{
+    uint64_t    lo = 0,
+                hi = c->h.nitems;
+
+    if (c->keys == NULL)
+        return intmap_find(c->data, &c->h, key);
+
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+
+        if (c->keys[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo < c->h.nitems && c->keys[lo] == key ? (int64_t) lo : -1;
+}
+
+/*
+ * intmap_lookup
+ *      Find the position of the key. Returns false if key is not found.
+ *
+ * On success a reference to the map is returned as well, so that values can
+ * be fetched with intmap_ref_value().
+ */
+static bool intmap_lookup(Datum datum, int64_t key, IntMapRef *ref,
+                          uint64_t *pos)
+{
+    Pointer      in = DatumGetPointer(datum);
+    IntMapCache *cache;
+    int64_t      res;
+
+    cache = intmap_cache_get(datum);
+    if (cache) {
+        if ((cache->h.flags & INTMAP_FLAG_BLOOM) &&
+            !bloom_may_contain(cache->h.bloom, cache->h.bloom_size, key))
+            return false;
+
+        res = intmap_cache_find(cache, key);
+        if (res < 0)
+            return false;
+
+        ref->h = cache->h;
+        ref->data = cache->data;
+        ref->values = cache->values;
+        *pos = res;
+        return true;
+    }
+
+    /* try to avoid detoasting the entire map */
+    if (intmap_slice_is_cheap(in) && !intmap_toasted_may_contain(datum, key))
+        return false;
+
+    in = (Pointer) PG_DETOAST_DATUM(datum);
+
+    /* read header */
+    ref->data = intmap_read_header((uint8_t *) VARDATA(in), &ref->h);
+    ref->values = NULL;
+
+    if ((ref->h.flags & INTMAP_FLAG_BLOOM) &&
+        !bloom_may_contain(ref->h.bloom, ref->h.bloom_size, key))
+        return false;
+
+    res = intmap_find(ref->data, &ref->h, key);
+    if (res < 0)
+        return false;
+
+    *pos = res;
+    return true;
+}
+
+static inline int64_t intmap_ref_value(IntMapRef *ref, uint8_t col,
+                                       uint64_t pos)
+{
+    if (ref->values)
+        return ref->values[col * ref->h.nitems + pos];
+
+    return intmap_value_at(ref->data, &ref->h, col, pos);
+}
+
+static uint8_t parse_layout(const char *layout)
+{
+    if (strcmp(layout, "sorted") == 0)
+        return 0;
+    if (strcmp(layout, "hash") == 0)
+        return INTMAP_FLAG_HASH;
+
+    elog(ERROR, "unknown intmap layout \"%s\"", layout);
+}
+
+PG_FUNCTION_INFO_V1(intmap_in);
+Datum intmap_in(PG_FUNCTION_ARGS)
+{
+    char    *in = PG_GETARG_CSTRING(0);
+    int64_t *keys;
+    int64_t *values;
+    int      n;
+    int      ncols;
+
+    parse_intmap(in, &keys, &values, &n, &ncols);
+    if (ncols > INTMAP_MAX_COLUMNS)
+        elog(ERROR, "number of value columns must not exceed %d",
+             INTMAP_MAX_COLUMNS);
+
+    return create_intmap_internal(keys, values, n, ncols, 0);
+}
+
+PG_FUNCTION_INFO_V1(intmap_out);
+Datum intmap_out(PG_FUNCTION_ARGS)
+{
+    Datum        in = PointerGetDatum(PG_DETOAST_DATUM(PG_GETARG_DATUM(0)));
+    uint8_t     *data = VARDATA(in);
+    IntMapHeader h;
+    DecoderIter  k_it, v_it[INTMAP_MAX_COLUMNS];
+    StringInfoData str;
+
+    data = intmap_read_header(data, &h);
+
+    /* iterate through keys/values */
+    decoder_iter_init(&k_it, h.key_enc, data, h.nitems);
+    for (uint8_t c = 0; c < h.ncols; ++c)
+        decoder_iter_init(&v_it[c], h.val_enc[c], data + h.valoff[c], h.nitems);
+    initStringInfo(&str);
+    for (uint32_t i = 0; i < h.nitems; ++i) {
+        appendStringInfo(&str, i == 0 ? "%ld=>" : ", %ld=>",
+                         decoder_iter_next(&k_it));
+
+        /* multiple values are enclosed in curly braces */
+        if (h.ncols == 1)
+            appendStringInfo(&str, "%ld", decoder_iter_next(&v_it[0]));
+        else {
+            appendStringInfoChar(&str, '{');
+            for (uint8_t c = 0; c < h.ncols; ++c)
+                appendStringInfo(&str, c == 0 ? "%ld" : ", %ld",
+                                 decoder_iter_next(&v_it[c]));
+            appendStringInfoChar(&str, '}');
+        }
+    }
+
+    PG_RETURN_CSTRING(str.data);
+}
+
+/*
+ * create_intmap_internal
+ *      Encode sorted keys and corresponding values into intmap.
+ *
+ * Values are stored column by column: values[col * n + i]. The exact size of
+ * the result is known from the stats, so it is allocated upfront and input
+ * arrays are left intact.
+ */
+static Datum create_intmap_internal(const int64_t *keys, const int64_t *values,
+                                    uint32_t n, uint8_t ncols, uint8_t flags)
+{
+    struct varlena *out;
+    uint8_t    *data;
+    ArrayStats  key_stats, val_stats[INTMAP_MAX_COLUMNS];
+    uint8_t    *keys_start;
+    IntMapHeader h;
+    uint64_t    size;
+    uint64_t    offset;
+
+    if (ncols < 1 || ncols > INTMAP_MAX_COLUMNS)
+        elog(ERROR, "number of value columns must be between 1 and %d",
+             INTMAP_MAX_COLUMNS);
+
+    collect_stats(&key_stats, keys, n);
+    for (uint8_t c = 0; c < ncols; ++c)
+        collect_stats(&val_stats[c], values + c * n, n);
+
+    /* hash layout requires direct access to keys and values by position */
+    if (flags & INTMAP_FLAG_HASH) {
+        stats_force_encoding(&key_stats, BITPACK_ENCODING);
+        for (uint8_t c = 0; c < ncols; ++c)
+            stats_force_encoding(&val_stats[c], BITPACK_ENCODING);
+    }
+
+    if (ncols > 1)
+        flags |= INTMAP_FLAG_MULTI;
+    else
+        flags &= ~INTMAP_FLAG_MULTI;
+
+    /* Fill in the header */
+    h.version = INTMAP_VERSION;
+    h.flags   = flags;
+    h.nitems  = n;
+    h.ncols   = ncols;
+    h.key_enc = key_stats.best_encoding | (key_stats.use_zigzag ? ZIGZAG_ENCODING : 0);
+    offset = key_stats.best_size;
+    for (uint8_t c = 0; c < ncols; ++c) {
+        h.val_enc[c] = val_stats[c].best_encoding |
+            (val_stats[c].use_zigzag ? ZIGZAG_ENCODING : 0);
+        h.valoff[c] = offset;
+        offset += val_stats[c].best_size;
+    }
+    h.hashoff = offset;
+    h.bloom_size = bloom_size(n);
+
+    /* keys and values are followed by the hash index */
+    size = VARHDRSZ + intmap_header_size(&h) + offset;
+    if (flags & INTMAP_FLAG_HASH)
+        size += hash_index_size(n);
+    if (size > MaxAllocSize)
+        elog(ERROR, "intmap size exceeds the maximum allowed (%zu bytes)",
+             (size_t) MaxAllocSize);
+
+    out = alloc_varlena(size);
+    keys_start = data = intmap_write_header((uint8_t *) VARDATA(out), &h);
+
+    if (flags & INTMAP_FLAG_BLOOM)
+        for (uint32_t i = 0; i < n; ++i)
+            bloom_add(h.bloom, h.bloom_size, keys[i]);
+
+    /* Encode keys and values */
+    data = encode_array(data, &key_stats, keys, n);
+    Assert(data == keys_start + key_stats.best_size);
+    for (uint8_t c = 0; c < ncols; ++c) {
+        Assert(data == keys_start + h.valoff[c]);
+        data = encode_array(data, &val_stats[c], values + c * n, n);
+    }
+
+    if (flags & INTMAP_FLAG_HASH) {
+        Assert(data == keys_start + h.hashoff);
+        data = hash_index_encode(data, keys, n);
+    }
+
+    Assert(data == (uint8_t *) out + size);
+    return PointerGetDatum(out);
+}
+
+
+/*
+ * array_get_int64
+ *      Get elements of int8[] or int4[] array without deconstructing it.
+ *
+ * Elements of int8[] are returned in place and must not be modified. int4[]
+ * elements are converted into the scratch buffer.
+ */
+static const int64_t *array_get_int64(ArrayType *arr, uint32_t *n,
+                                      ScratchBuf *scratch)
+{
+    const int64_t *res;
+
+    if (array_contains_nulls(arr))
+        elog(ERROR, "input arrays must not contain NULLs");
+
+    *n = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+
+    switch (ARR_ELEMTYPE(arr))
+    {
+        case INT8OID:
+            res = (const int64_t *) ARR_DATA_PTR(arr);
+            break;
+        case INT4OID:
+            {
+                int32_t *src = (int32_t *) ARR_DATA_PTR(arr);
+                int64_t *dst = scratch_get(scratch, sizeof(int64_t) * *n);
+
+                for (uint32_t i = 0; i < *n; ++i)
+                    dst[i] = src[i];
+                res = dst;
+                break;
+            }
+        default:
+            elog(ERROR, "unsupported array element type");
+    }
+
+    return res;
+}
+
+/*
+ * new_array
+ *      Allocate an array without nulls, so that values can be decoded
+ *      straight into ARR_DATA_PTR().
+ */
+static ArrayType *new_array(Oid elemtype, int elemsize, int ndim, int *dims)
+{
+    ArrayType  *arr;
+    int         nitems = ArrayGetNItems(ndim, dims);
+    Size        size;
+
+    if (nitems == 0)
+        return construct_empty_array(elemtype);
+
+    size = ARR_OVERHEAD_NONULLS(ndim) + (Size) elemsize * nitems;
+    arr = palloc0(size);
+    SET_VARSIZE(arr, size);
+    arr->ndim = ndim;
+    arr->dataoffset = 0;
+    arr->elemtype = elemtype;
+    for (int i = 0; i < ndim; ++i) {
+        ARR_DIMS(arr)[i] = dims[i];
+        ARR_LBOUND(arr)[i] = 1;
+    }
+
+    return arr;
+}
+
+PG_FUNCTION_INFO_V1(create_intmap);
+Datum create_intmap(PG_FUNCTION_ARGS)
+{
+    ArrayType  *keys_arr = PG_GETARG_ARRAYTYPE_P(0);
+    ArrayType  *values_arr = PG_GETARG_ARRAYTYPE_P(1);
+    uint8_t     flags = 0;
+    const int64_t *keys, *values;
+    uint32_t    nkeys, nvalues;
+    uint8_t     ncols = 1;
+
+    if (PG_NARGS() > 2)
+        flags |= parse_layout(text_to_cstring(PG_GETARG_TEXT_PP(2)));
+    if (PG_NARGS() > 3 && PG_GETARG_BOOL(3))
+        flags |= INTMAP_FLAG_BLOOM;
+
+    if (ARR_NDIM(keys_arr) > 1)
+        elog(ERROR, "keys array must be one-dimensional");
+
+    keys = array_get_int64(keys_arr, &nkeys, &scratch_keys);
+    values = array_get_int64(values_arr, &nvalues, &scratch_values);
+
+    /* two-dimensional values array holds one value column per row */
+    if (ARR_NDIM(values_arr) == 2) {
+        if (ARR_DIMS(values_arr)[0] > INTMAP_MAX_COLUMNS)
+            elog(ERROR, "number of value columns must not exceed %d",
+                 INTMAP_MAX_COLUMNS);
+        ncols = ARR_DIMS(values_arr)[0];
+    } else if (ARR_NDIM(values_arr) > 2)
+        elog(ERROR, "values array must be one- or two-dimensional");
+
+    if ((uint64_t) nkeys * ncols != nvalues)
+        elog(ERROR, "the keys array size does not match the values array size");
+
+    /* arrays are only copied if they need sorting */
+    for (uint32_t i = 1; i < nkeys; ++i)
+        if (keys[i - 1] > keys[i]) {
+            int64_t *k = scratch_get(&scratch_keys, sizeof(int64_t) * nkeys);
+            int64_t *v = scratch_get(&scratch_values, sizeof(int64_t) * nvalues);
+
+            memmove(k, keys, sizeof(int64_t) * nkeys);
+            memmove(v, values, sizeof(int64_t) * nvalues);
+            intmap_sort(k, v, nkeys, ncols);
+            keys = k;
+            values = v;
+            break;
+        }
+
+    return create_intmap_internal(keys, values, nkeys, ncols, flags);
+}
+
+/*
+ * intmap_to_arrays
+ *      Decode keys and values straight into int8 arrays. Values of a
+ *      multi-column map are returned as a two-dimensional array, one column
+ *      per row.
+ */
+PG_FUNCTION_INFO_V1(intmap_to_arrays);
+Datum intmap_to_arrays(PG_FUNCTION_ARGS)
+{
+    struct varlena *in = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    uint8_t    *data;
+    IntMapHeader h;
+    ArrayType  *keys_arr, *values_arr;
+    TupleDesc   tupdesc;
+    Datum       result[2];
+    bool        nulls[2] = {false, false};
+    int         dims[2];
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+    tupdesc = BlessTupleDesc(tupdesc);
+
+    data = intmap_read_header((uint8_t *) VARDATA(in), &h);
+
+    dims[0] = h.nitems;
+    keys_arr = new_array(INT8OID, sizeof(int64_t), 1, dims);
+    if (h.ncols > 1) {
+        dims[0] = h.ncols;
+        dims[1] = h.nitems;
+        values_arr = new_array(INT8OID, sizeof(int64_t), 2, dims);
+    } else
+        values_arr = new_array(INT8OID, sizeof(int64_t), 1, dims);
+
+    if (h.nitems > 0)
+        intmap_decode(data, &h, (int64_t *) ARR_DATA_PTR(keys_arr),
+                      (int64_t *) ARR_DATA_PTR(values_arr));
+
+    result[0] = PointerGetDatum(keys_arr);
+    result[1] = PointerGetDatum(values_arr);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, result, nulls)));
+}
+
+
+PG_FUNCTION_INFO_V1(intmap_get_val);
+Datum intmap_get_val(PG_FUNCTION_ARGS)
+{
+    int64_t      key = PG_GETARG_INT64(1);
+    IntMapRef    ref;
+    uint64_t     pos;
+
+    if (intmap_lookup(PG_GETARG_DATUM(0), key, &ref, &pos))
+        PG_RETURN_INT64(intmap_ref_value(&ref, 0, pos));
+
+    /* key's not found */
+    PG_RETURN_NULL();
+}
+
+PG_FUNCTION_INFO_V1(intmap_get_col_val);
+Datum intmap_get_col_val(PG_FUNCTION_ARGS)
+{
+    int64_t      key = PG_GETARG_INT64(1);
+    int32_t      col = PG_GETARG_INT32(2);
+    IntMapRef    ref;
+    uint64_t     pos;
+
+    if (!intmap_lookup(PG_GETARG_DATUM(0), key, &ref, &pos))
+        PG_RETURN_NULL();
+
+    /* columns are numbered from 1 */
+    if (col < 1 || col > ref.h.ncols)
+        elog(ERROR, "column number %d is out of range", col);
+
+    PG_RETURN_INT64(intmap_ref_value(&ref, col - 1, pos));
+}
+
+PG_FUNCTION_INFO_V1(intmap_get_vals);
+Datum intmap_get_vals(PG_FUNCTION_ARGS)
+{
+    int64_t      key = PG_GETARG_INT64(1);
+    IntMapRef    ref;
+    uint64_t     pos;
+    Datum        values[INTMAP_MAX_COLUMNS];
+
+    if (!intmap_lookup(PG_GETARG_DATUM(0), key, &ref, &pos))
+        PG_RETURN_NULL();
+
+    for (uint8_t c = 0; c < ref.h.ncols; ++c)
+        values[c] = Int64GetDatum(intmap_ref_value(&ref, c, pos));
+
+    PG_RETURN_ARRAYTYPE_P(construct_array(values, ref.h.ncols, INT8OID,
+                                          sizeof(int64_t), true, 'd'));
+}
+
+PG_FUNCTION_INFO_V1(intmap_exists);
+Datum intmap_exists(PG_FUNCTION_ARGS)
+{
+    int64_t      key = PG_GETARG_INT64(1);
+    IntMapRef    ref;
+    uint64_t     pos;
+
+    PG_RETURN_BOOL(intmap_lookup(PG_GETARG_DATUM(0), key, &ref, &pos));
+}
+
+/*
+ * intmap_set_internal
+ *      Add or replace an entry. vals must contain a value for each column.
+ */
+static Datum intmap_set_internal(struct varlena *in, int64_t key,
+                                 int64_t *vals, uint32_t nvals)
+{
+    uint8_t    *data;
+    IntMapHeader h;
+    int64_t     pos;
+    int64_t    *keys, *values;
+    uint64_t    n;
+
+    data = intmap_read_header((uint8_t *) VARDATA(in), &h);
+    if (nvals != h.ncols)
+        elog(ERROR, "number of values (%u) does not match the number of intmap columns (%u)",
+             nvals, h.ncols);
+
+    pos = intmap_find(data, &h, key);
+
+    /*
+     * Existing key: try to patch the values in a copy of the map.
+     */
+    if (pos >= 0) {
+        struct varlena *out = alloc_varlena(VARSIZE(in));
+        uint8_t     c;
+
+        memcpy(out, in, VARSIZE(in));
+        data = intmap_read_header((uint8_t *) VARDATA(out), &h);
+        for (c = 0; c < h.ncols; ++c)
+            if (!intmap_patch_value(data, &h, c, pos, vals[c]))
+                break;
+        if (c == h.ncols)
+            return PointerGetDatum(out);
+        pfree(out);
+        data = intmap_read_header((uint8_t *) VARDATA(in), &h);
+    }
+
+    /* Otherwise decode, modify and encode back */
+    n = h.nitems;
+    keys = palloc(sizeof(int64_t) * (n + 1) * (h.ncols + 1));
+    values = keys + n + 1;
+    intmap_decode(data, &h, keys, values);
+
+    if (pos >= 0) {
+        for (uint8_t c = 0; c < h.ncols; ++c)
+            values[c * n + pos] = vals[c];
+    } else {
+        uint64_t i = 0;
+
+        /* find position to insert the new key keeping keys sorted */
+        while (i < n && keys[i] < key)
+            i++;
+        memmove(keys + i + 1, keys + i, sizeof(int64_t) * (n - i));
+        keys[i] = key;
+
+        /*
+         * Columns are shifted to their new locations starting from the last
+         * one, so that they don't overlap.
+         */
+        for (int c = h.ncols - 1; c >= 0; --c) {
+            int64_t *src = values + c * n;
+            int64_t *dst = values + c * (n + 1);
+
+            memmove(dst + i + 1, src + i, sizeof(int64_t) * (n - i));
+            memmove(dst, src, sizeof(int64_t) * i);
+            dst[i] = vals[c];
+        }
+        n++;
+    }
+
+    return create_intmap_internal(keys, values, n, h.ncols, h.flags);
+}
+
+PG_FUNCTION_INFO_V1(intmap_set);
+Datum intmap_set(PG_FUNCTION_ARGS)
+{
+    struct varlena *in = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    int64_t     key = PG_GETARG_INT64(1);
+    int64_t     val = PG_GETARG_INT64(2);
+
+    return intmap_set_internal(in, key, &val, 1);
+}
+
+PG_FUNCTION_INFO_V1(intmap_set_vals);
+Datum intmap_set_vals(PG_FUNCTION_ARGS)
+{
+    struct varlena *in = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    int64_t     key = PG_GETARG_INT64(1);
+    ArrayType  *vals_arr = PG_GETARG_ARRAYTYPE_P(2);
+    Datum      *vals;
+    bool       *nulls;
+    int         nvals;
+
+    deconstruct_array(vals_arr, INT8OID, sizeof(int64_t), true, 'd',
+                      &vals, &nulls, &nvals);
+
+    for (int i = 0; i < nvals; ++i)
+        if (nulls[i])
+            elog(ERROR, "input arrays must not contain NULLs");
+
+    return intmap_set_internal(in, key, (int64_t *) vals, nvals);
+}
+
+PG_FUNCTION_INFO_V1(intmap_delete);
+Datum intmap_delete(PG_FUNCTION_ARGS)
+{
+    struct varlena *in = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    int64_t     key = PG_GETARG_INT64(1);
+    uint8_t    *data;
+    IntMapHeader h;
+    int64_t     pos;
+    int64_t    *keys, *values;
+    uint64_t    n;
+
+    data = intmap_read_header((uint8_t *) VARDATA(in), &h);
+    pos = intmap_find(data, &h, key);
+
+    /* nothing to delete */
+    if (pos < 0)
+        PG_RETURN_POINTER(in);
+
+    n = h.nitems;
+    keys = palloc(sizeof(int64_t) * n * (h.ncols + 1));
+    values = keys + n;
+    intmap_decode(data, &h, keys, values);
+
+    memmove(keys + pos, keys + pos + 1, sizeof(int64_t) * (n - pos - 1));
+
+    /* compact columns leaving out the deleted entry */
+    for (uint8_t c = 0; c < h.ncols; ++c) {
+        int64_t *src = values + c * n;
+        int64_t *dst = values + c * (n - 1);
+
+        memmove(dst, src, sizeof(int64_t) * pos);
+        memmove(dst + pos, src + pos + 1, sizeof(int64_t) * (n - pos - 1));
+    }
+
+    return create_intmap_internal(keys, values, n - 1, h.ncols, h.flags);
+}
+
+PG_FUNCTION_INFO_V1(intmap_range);
+Datum intmap_range(PG_FUNCTION_ARGS)
+{
+    struct varlena *in = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    int64_t     lo = PG_GETARG_INT64(1);
+    int64_t     hi = PG_GETARG_INT64(2);
+    uint8_t    *data;
+    IntMapHeader h;
+    DecoderIter it;
+    uint64_t    start;
+    uint64_t    n = 0;
+    uint64_t    max;
+    int64_t    *keys, *values;
+
+    data = intmap_read_header((uint8_t *) VARDATA(in), &h);
+    start = intmap_lower_bound(data, &h, lo);
+    max = h.nitems - start;
+
+    keys = palloc(sizeof(int64_t) * max * (h.ncols + 1));
+    values = keys + max;
+
+    /* start decoding at the first key within the range */
+    decoder_iter_init(&it, h.key_enc, data, h.nitems);
+    decoder_iter_skip(&it, start);
+    while (n < max) {
+        int64_t key = decoder_iter_next(&it);
+
+        if (key > hi)
+            break;
+        keys[n++] = key;
+    }
+
+    /* then decode the same number of values in each column */
+    for (uint8_t c = 0; c < h.ncols; ++c) {
+        decoder_iter_init(&it, h.val_enc[c], data + h.valoff[c], h.nitems);
+        decoder_iter_skip(&it, start);
+        for (uint64_t i = 0; i < n; ++i)
+            values[c * n + i] = decoder_iter_next(&it);
+    }
+
+    return create_intmap_internal(keys, values, n, h.ncols, h.flags);
+}
+
+typedef struct
+{
+    DecoderIter k_it;
+    DecoderIter v_it;
+    uint64_t    pos;
+    uint64_t    nitems;
+    int64_t     hi;
+} IntMapRangeState;
+
+PG_FUNCTION_INFO_V1(intmap_range_each);
+Datum intmap_range_each(PG_FUNCTION_ARGS)
+{
+    FuncCallContext  *funcctx;
+    IntMapRangeState *state;
+    int64_t           key;
+    Datum             values[2];
+    bool              nulls[2] = {false, false};
+
+    if (SRF_IS_FIRSTCALL()) {
+        MemoryContext   oldcontext;
+        struct varlena *in;
+        uint8_t        *data;
+        IntMapHeader    h;
+        TupleDesc       tupdesc;
+        uint64_t        start;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            elog(ERROR, "return type must be a row type");
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        /* detoasted map must survive between calls */
+        in = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+        data = intmap_read_header((uint8_t *) VARDATA(in), &h);
+        start = intmap_lower_bound(data, &h, PG_GETARG_INT64(1));
+
+        /* only the first value column is returned */
+        state = palloc(sizeof(IntMapRangeState));
+        decoder_iter_init(&state->k_it, h.key_enc, data, h.nitems);
+        decoder_iter_init(&state->v_it, h.val_enc[0], data + h.valoff[0], h.nitems);
+        decoder_iter_skip(&state->k_it, start);
+        decoder_iter_skip(&state->v_it, start);
+        state->pos = start;
+        state->nitems = h.nitems;
+        state->hi = PG_GETARG_INT64(2);
+        funcctx->user_fctx = state;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    state = funcctx->user_fctx;
+
+    if (state->pos >= state->nitems)
+        SRF_RETURN_DONE(funcctx);
+
+    key = decoder_iter_next(&state->k_it);
+    if (key > state->hi)
+        SRF_RETURN_DONE(funcctx);
+
+    values[0] = Int64GetDatum(key);
+    values[1] = Int64GetDatum(decoder_iter_next(&state->v_it));
+    state->pos++;
+
+    SRF_RETURN_NEXT(funcctx,
+                    HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc,
+                                                      values, nulls)));
+}
+
+/*
+ * Top-N heap entry
+ */
+typedef struct
+{
+    int64_t  key;
+    int64_t  value;
+    uint64_t pos;
+} IntMapEntry;
+
+/*
+ * Heap order: smaller values first, for equal values larger keys first, so
+ * that smaller keys win the ties.
+ */
+static inline bool entry_lt(IntMapEntry *a, IntMapEntry *b)
+{
+    return a->value < b->value || (a->value == b->value && a->key > b->key);
+}
+
+static void heap_sift_down(IntMapEntry *heap, uint32_t n, uint32_t i)
+{
+    while (true) {
+        uint32_t    smallest = i;
+        uint32_t    l = 2 * i + 1,
+                    r = 2 * i + 2;
+        IntMapEntry tmp;
+
+        if (l < n && entry_lt(&heap[l], &heap[smallest]))
+            smallest = l;
+        if (r < n && entry_lt(&heap[r], &heap[smallest]))
+            smallest = r;
+        if (smallest == i)
+            break;
+
+        tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+static int entry_pos_cmp(const void *a, const void *b)
+{
+    uint64_t pa = ((const IntMapEntry *) a)->pos;
+    uint64_t pb = ((const IntMapEntry *) b)->pos;
+
+    return pa < pb ? -1 : pa > pb;
+}
+
+/*
+ * intmap_topn
+ *      N entries with the largest values (of the first column).
+ */
+PG_FUNCTION_INFO_V1(intmap_topn);
+Datum intmap_topn(PG_FUNCTION_ARGS)
+{
+    struct varlena *in = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    int32_t     topn = PG_GETARG_INT32(1);
+    uint8_t    *data;
+    IntMapHeader h;
+    DecoderIter k_it, v_it;
+    IntMapEntry *heap;
+    int64_t    *keys, *values;
+    uint32_t    n = 0;
+
+    if (topn < 0)
+        elog(ERROR, "number of entries must not be negative");
+
+    data = intmap_read_header((uint8_t *) VARDATA(in), &h);
+
+    /* the whole map fits */
+    if (topn >= h.nitems)
+        PG_RETURN_POINTER(in);
+
+    /* bounded min-heap keeping the largest values seen so far */
+    heap = palloc(sizeof(IntMapEntry) * (topn + 1));
+    decoder_iter_init(&k_it, h.key_enc, data, h.nitems);
+    decoder_iter_init(&v_it, h.val_enc[0], data + h.valoff[0], h.nitems);
+    for (uint64_t i = 0; i < h.nitems; ++i) {
+        IntMapEntry e;
+
+        e.key = decoder_iter_next(&k_it);
+        e.value = decoder_iter_next(&v_it);
+        e.pos = i;
+
+        if (n < topn) {
+            uint32_t j = n++;
+
+            /* sift up */
+            heap[j] = e;
+            while (j > 0 && entry_lt(&heap[j], &heap[(j - 1) / 2])) {
+                IntMapEntry tmp = heap[j];
+
+                heap[j] = heap[(j - 1) / 2];
+                heap[(j - 1) / 2] = tmp;
+                j = (j - 1) / 2;
+            }
+        } else if (n > 0 && entry_lt(&heap[0], &e)) {
+            heap[0] = e;
+            heap_sift_down(heap, n, 0);
+        }
+    }
+
+    /* restore the original (sorted by key) order */
+    qsort(heap, n, sizeof(IntMapEntry), entry_pos_cmp);
+
+    keys = palloc(sizeof(int64_t) * n * (h.ncols + 1));
+    values = keys + n;
+    for (uint32_t i = 0; i < n; ++i) {
+        keys[i] = heap[i].key;
+        values[i] = heap[i].value;
+    }
+
+    /* fetch the rest of the columns */
+    for (uint8_t c = 1; c < h.ncols; ++c) {
+        DecoderIter it;
+        uint64_t    pos = 0;
+
+        decoder_iter_init(&it, h.val_enc[c], data + h.valoff[c], h.nitems);
+        for (uint32_t i = 0; i < n; ++i) {
+            decoder_iter_skip(&it, heap[i].pos - pos);
+            values[c * n + i] = decoder_iter_next(&it);
+            pos = heap[i].pos + 1;
+        }
+    }
+
+    return create_intmap_internal(keys, values, n, h.ncols, h.flags);
+}
+
+typedef enum
+{
+    FILTER_EQ,
+    FILTER_NE,
+    FILTER_LT,
+    FILTER_LE,
+    FILTER_GT,
+    FILTER_GE
+} FilterOp;
+
+static FilterOp parse_filter_op(const char *op)
+{
+    if (strcmp(op, "=") == 0)
+        return FILTER_EQ;
+    if (strcmp(op, "<>") == 0 || strcmp(op, "!=") == 0)
+        return FILTER_NE;
+    if (strcmp(op, "<") == 0)
+        return FILTER_LT;
+    if (strcmp(op, "<=") == 0)
+        return FILTER_LE;
+    if (strcmp(op, ">") == 0)
+        return FILTER_GT;
+    if (strcmp(op, ">=") == 0)
+        return FILTER_GE;
+
+    elog(ERROR, "unknown comparison operator \"%s\"", op);
+}
+
+/*
+ * intmap_value_bounds
+ *      Range the values of the column are guaranteed to fall into. Returns
+ *      false if nothing is known.
+ *
+ * Encoding is canonical, so a column without zigzag has no negative values,
+ * and the width of bit packed values bounds their magnitude.
+ */
+static bool intmap_value_bounds(uint8_t *data, IntMapHeader *h, uint8_t col,
+                                int64_t *min, int64_t *max)
+{
+    uint8_t     encoding = h->val_enc[col];
+    uint8_t     num_bits;
+
+    if ((encoding & 0x7) != BITPACK_ENCODING) {
+        if (encoding & ZIGZAG_ENCODING)
+            return false;
+        *min = 0;
+        *max = INT64_MAX;
+        return true;
+    }
+
+    read_num_bits(data + h->valoff[col], &num_bits);
+    if (encoding & ZIGZAG_ENCODING) {
+        *max = num_bits > 0 ? (int64_t) bitpack_mask(num_bits - 1) : 0;
+        *min = num_bits > 0 ? -*max - 1 : 0;
+    } else {
+        *min = 0;
+        *max = num_bits < 63 ? (int64_t) bitpack_mask(num_bits) : INT64_MAX;
+    }
+
+    return true;
+}
+
+/*
+ * filter_bounds_test
+ *      Check the predicate against the range of values: returns 1 if every
+ *      value matches, -1 if none does and 0 if values have to be checked.
+ */
+static int filter_bounds_test(FilterOp op, int64_t operand, int64_t min,
+                              int64_t max)
+{
+    switch (op)
+    {
+        case FILTER_EQ:
+            if (operand < min || operand > max)
+                return -1;
+            return min == max ? 1 : 0;
+        case FILTER_NE:
+            if (operand < min || operand > max)
+                return 1;
+            return min == max ? -1 : 0;
+        case FILTER_LT:
+            return max < operand ? 1 : (min >= operand ? -1 : 0);
+        case FILTER_LE:
+            return max <= operand ? 1 : (min > operand ? -1 : 0);
+        case FILTER_GT:
+            return min > operand ? 1 : (max <= operand ? -1 : 0);
+        case FILTER_GE:
+            return min >= operand ? 1 : (max < operand ? -1 : 0);
+    }
+
+    return 0;
+}
+
+/*
+ * filter_block
+ *      Set mask[i] to 1 for values matching the predicate and 0 otherwise,
+ *      return the number of matches. The loops have no branches, so that
+ *      the compiler can turn them into SIMD compares.
+ */
+static inline uint32_t filter_block(const int64_t *vals, uint32_t n,
+                                    FilterOp op, int64_t operand, uint8_t *mask)
+{
+    uint32_t    matched = 0;
+
+#define FILTER_LOOP(cmp) \
+    for (uint32_t i = 0; i < n; ++i) \
+        mask[i] = vals[i] cmp operand
+
+    switch (op)
+    {
+        case FILTER_EQ: FILTER_LOOP(==); break;
+        case FILTER_NE: FILTER_LOOP(!=); break;
+        case FILTER_LT: FILTER_LOOP(<); break;
+        case FILTER_LE: FILTER_LOOP(<=); break;
+        case FILTER_GT: FILTER_LOOP(>); break;
+        case FILTER_GE: FILTER_LOOP(>=); break;
+    }
+
+#undef FILTER_LOOP
+
+    for (uint32_t i = 0; i < n; ++i)
+        matched += mask[i];
+
+    return matched;
+}
+
+/*
+ * intmap_filter_scan
+ *      Evaluate the predicate on the first value column a block at a time and
+ *      return the number of matching entries. If mask is given, it receives
+ *      a flag for every entry and blkcnt the number of matches in each block.
+ */
+static uint64_t intmap_filter_scan(uint8_t *data, IntMapHeader *h,
+                                   FilterOp op, int64_t operand,
+                                   uint8_t *mask, uint32_t *blkcnt)
+{
+    DecoderIter it;
+    int64_t     block[DECODE_BLOCK_SIZE];
+    uint8_t     blkmask[DECODE_BLOCK_SIZE];
+    uint64_t    total = 0;
+
+    decoder_iter_init(&it, h->val_enc[0], data + h->valoff[0], h->nitems);
+    for (uint64_t i = 0; i < h->nitems; i += DECODE_BLOCK_SIZE) {
+        uint32_t cnt = Min(h->nitems - i, DECODE_BLOCK_SIZE);
+        uint32_t matched;
+
+        decoder_iter_next_block(&it, block, cnt);
+        matched = filter_block(block, cnt, op, operand,
+                               mask ? mask + i : blkmask);
+        if (blkcnt)
+            blkcnt[i / DECODE_BLOCK_SIZE] = matched;
+        total += matched;
+    }
+
+    return total;
+}
+
+/*
+ * filter_gather
+ *      Copy values flagged in the mask to out. Blocks without matches are
+ *      skipped (without decoding if values are bit packed).
+ *
+ * Every value is stored and the output position only advances on a match,
+ * so one slot past the last match may be written.
+ */
+static void filter_gather(DecoderIter *it, uint64_t nitems,
+                          const uint8_t *mask, const uint32_t *blkcnt,
+                          int64_t *out)
+{
+    int64_t     block[DECODE_BLOCK_SIZE];
+
+    for (uint64_t i = 0; i < nitems; i += DECODE_BLOCK_SIZE) {
+        uint32_t cnt = Min(nitems - i, DECODE_BLOCK_SIZE);
+
+        if (blkcnt[i / DECODE_BLOCK_SIZE] == 0) {
+            /* no need to position the iterator past the last block */
+            if (i + cnt < nitems)
+                decoder_iter_skip(it, cnt);
+            continue;
+        }
+
+        decoder_iter_next_block(it, block, cnt);
+        for (uint32_t j = 0; j < cnt; ++j) {
+            *out = block[j];
+            out += mask[i + j];
+        }
+    }
+}
+
+/*
+ * intmap_filter
+ *      Entries whose value (of the first column) satisfies
+ *      "value op operand".
+ */
+PG_FUNCTION_INFO_V1(intmap_filter);
+Datum intmap_filter(PG_FUNCTION_ARGS)
+{
+    struct varlena *in = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    FilterOp    op = parse_filter_op(text_to_cstring(PG_GETARG_TEXT_PP(1)));
+    int64_t     operand = PG_GETARG_INT64(2);
+    uint8_t    *data;
+    IntMapHeader h;
+    DecoderIter it;
+    int64_t     min, max;
+    int         test = 0;
+    uint8_t    *mask = NULL;
+    uint32_t   *blkcnt = NULL;
+    uint64_t    n;
+    uint64_t    nblocks;
+    int64_t    *keys, *values;
+
+    data = intmap_read_header((uint8_t *) VARDATA(in), &h);
+
+    if (h.nitems == 0)
+        PG_RETURN_POINTER(in);
+    if (intmap_value_bounds(data, &h, 0, &min, &max))
+        test = filter_bounds_test(op, operand, min, max);
+    if (test > 0)
+        PG_RETURN_POINTER(in);
+
+    n = 0;
+    if (test == 0) {
+        mask = palloc(h.nitems);
+        nblocks = (h.nitems + DECODE_BLOCK_SIZE - 1) / DECODE_BLOCK_SIZE;
+        blkcnt = palloc(sizeof(uint32_t) * nblocks);
+        n = intmap_filter_scan(data, &h, op, operand, mask, blkcnt);
+        if (n == h.nitems)
+            PG_RETURN_POINTER(in);
+    }
+
+    /* one extra slot for filter_gather() to write past the last column */
+    keys = palloc(sizeof(int64_t) * (n * (h.ncols + 1) + 1));
+    values = keys + n;
+    if (n == 0)
+        return create_intmap_internal(keys, values, 0, h.ncols, h.flags);
+
+    decoder_iter_init(&it, h.key_enc, data, h.nitems);
+    filter_gather(&it, h.nitems, mask, blkcnt, keys);
+    for (uint8_t c = 0; c < h.ncols; ++c) {
+        decoder_iter_init(&it, h.val_enc[c], data + h.valoff[c], h.nitems);
+        filter_gather(&it, h.nitems, mask, blkcnt, values + c * n);
+    }
+
+    return create_intmap_internal(keys, values, n, h.ncols, h.flags);
+}
+
+/*
+ * intmap_count_where
+ *      Number of entries whose value (of the first column) satisfies
+ *      "value op operand".
+ */
+PG_FUNCTION_INFO_V1(intmap_count_where);
+Datum intmap_count_where(PG_FUNCTION_ARGS)
+{
+    struct varlena *in = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    FilterOp    op = parse_filter_op(text_to_cstring(PG_GETARG_TEXT_PP(1)));
+    int64_t     operand = PG_GETARG_INT64(2);
+    uint8_t    *data;
+    IntMapHeader h;
+    int64_t     min, max;
+    int         test = 0;
+
+    data = intmap_read_header((uint8_t *) VARDATA(in), &h);
+
+    if (h.nitems > 0 && intmap_value_bounds(data, &h, 0, &min, &max))
+        test = filter_bounds_test(op, operand, min, max);
+    if (test > 0)
+        PG_RETURN_INT64(h.nitems);
+    if (test < 0)
+        PG_RETURN_INT64(0);
+
+    PG_RETURN_INT64(intmap_filter_scan(data, &h, op, operand, NULL, NULL));
+}
+
+static inline const char *encoding_to_str(uint8_t encoding)
+{
+    switch (encoding) {
+        case VARINT_ENCODING:
+            return "varint";
+        case BITPACK_ENCODING:
+            return "bit-pack";
+        case VARINT_ENCODING | ZIGZAG_ENCODING:
+            return "varint (zig-zag)";
+        case BITPACK_ENCODING | ZIGZAG_ENCODING:
+            return "bit-pack (zig-zag)";
+        default:
+            elog(ERROR, "unexpected encoding");
+    }
+}
+
+PG_FUNCTION_INFO_V1(intmap_meta);
+Datum intmap_meta(PG_FUNCTION_ARGS)
+{
+    Datum in = PointerGetDatum(PG_DETOAST_DATUM(PG_GETARG_DATUM(0)));
+    uint8_t *data = VARDATA(in);
+    IntMapHeader h;
+    StringInfoData str;
+
+    /* read header */
+    data = intmap_read_header(data, &h);
+
+    initStringInfo(&str);
+    appendStringInfo(&str, "ver: %u, num: " UINT64_FORMAT ", keys encoding: %s, values encoding: %s, layout: %s",
+                     h.version,
+                     h.nitems,
+                     encoding_to_str(h.key_enc),
+                     encoding_to_str(h.val_enc[0]),
+                     h.flags & INTMAP_FLAG_HASH ? "hash" : "sorted");
+    if (h.ncols > 1)
+        appendStringInfo(&str, ", columns: %u", h.ncols);
+    if (h.flags & INTMAP_FLAG_BLOOM)
+        appendStringInfo(&str, ", bloom filter: " UINT64_FORMAT " bytes",
+                         h.bloom_size);
+
+    PG_RETURN_CSTRING(str.data);
+}
+
+#define INTMAP_INFO_NATTS   17
+
+/*
+ * intmap_info
+ *      Report sizes of the map sections along with the sizes each section
+ *      would take with every supported encoding.
+ *
+ * Section sizes don't include the varlena header. Bit widths are the number
+ * of bits a value takes when bit packed (after zigzag encoding if needed).
+ */
+PG_FUNCTION_INFO_V1(intmap_info);
+Datum intmap_info(PG_FUNCTION_ARGS)
+{
+    struct varlena *in = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    uint8_t    *data;
+    IntMapHeader h;
+    TupleDesc   tupdesc;
+    Datum       result[INTMAP_INFO_NATTS];
+    bool        nulls[INTMAP_INFO_NATTS] = {false};
+    Datum       val_encs[INTMAP_MAX_COLUMNS];
+    Datum       val_bits[INTMAP_MAX_COLUMNS];
+    uint64_t    header_size, data_size, values_size, end;
+    uint64_t    varint_size, bitpack_size, best_size;
+    int64_t    *keys, *values;
+    ArrayStats  stats;
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+    tupdesc = BlessTupleDesc(tupdesc);
+
+    data = intmap_read_header((uint8_t *) VARDATA(in), &h);
+    header_size = data - (uint8_t *) VARDATA(in);
+    data_size = VARSIZE(in) - VARHDRSZ - header_size;
+    end = h.flags & INTMAP_FLAG_HASH ? h.hashoff : data_size;
+
+    keys = palloc(sizeof(int64_t) * (h.nitems * (h.ncols + 1) + 1));
+    values = keys + h.nitems;
+    intmap_decode(data, &h, keys, values);
+
+    /* keys */
+    collect_stats(&stats, keys, h.nitems);
+    varint_size = stats.varint_size;
+    bitpack_size = stats.bitpack_size;
+    best_size = stats.best_size;
+    result[10] = CStringGetTextDatum(encoding_to_str(h.key_enc));
+    result[11] = Int32GetDatum(stats.num_bits);
+
+    /* value columns */
+    for (uint8_t i = 0; i < h.ncols; ++i) {
+        collect_stats(&stats, values + i * h.nitems, h.nitems);
+        varint_size += stats.varint_size;
+        bitpack_size += stats.bitpack_size;
+        best_size += stats.best_size;
+        val_encs[i] = CStringGetTextDatum(encoding_to_str(h.val_enc[i]));
+        val_bits[i] = Int32GetDatum(stats.num_bits);
+    }
+    values_size = end - h.valoff[0];
+
+    result[0] = Int32GetDatum(h.version);
+    result[1] = Int64GetDatum(h.nitems);
+    result[2] = CStringGetTextDatum(h.flags & INTMAP_FLAG_HASH ? "hash" : "sorted");
+    result[3] = Int32GetDatum(h.ncols);
+    result[4] = Int64GetDatum(header_size - h.bloom_size);
+    result[5] = Int64GetDatum(h.bloom_size);
+    result[6] = Int64GetDatum(h.valoff[0]);
+    result[7] = Int64GetDatum(values_size);
+    result[8] = Int64GetDatum(data_size - end);
+    result[9] = Int64GetDatum(VARSIZE(in) - VARHDRSZ);
+    result[12] = PointerGetDatum(construct_array(val_encs, h.ncols, TEXTOID,
+                                                 -1, false, 'i'));
+    result[13] = PointerGetDatum(construct_array(val_bits, h.ncols, INT4OID,
+                                                 sizeof(int32), true, 'i'));
+    result[14] = Int64GetDatum(varint_size);
+    result[15] = Int64GetDatum(bitpack_size);
+    result[16] = Int64GetDatum(best_size);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, result, nulls)));
+}
+
+PG_FUNCTION_INFO_V1(intarr_in);
+Datum intarr_in(PG_FUNCTION_ARGS)
+{
+    char    *in = PG_GETARG_CSTRING(0);
+    int64_t *values;
+    int      n;
+
+    parse_intarr(in, &values, &n);
+
+    return create_intarr_internal(values, n);
+}
+
+static Datum create_intarr_internal(const int64_t *values, uint32_t n)
+{
+    struct varlena *out;
+    uint8_t    *data;
+    ArrayStats  stats;
+    uint64_t    size;
+
+    collect_stats(&stats, values, n);
+
+    /*
+     * Size includes:
+     * - bytea header (4 bytes)
+     * - version + encoding (1 byte)
+     * - varint encoded number of items
+     * - calculated size of encoded data
+     */
+    size = VARHDRSZ + 1 + varint_len(n) + stats.best_size;
+    if (size > MaxAllocSize)
+        elog(ERROR, "intarr size exceeds the maximum allowed (%zu bytes)",
+             (size_t) MaxAllocSize);
+
+    out = alloc_varlena(size);
+    data = (uint8_t *) VARDATA(out);
+
+    /*
+     * write the encoding
+     * TODO: write version into the same byte as well
+     */
+    *data++ = stats.best_encoding | (stats.use_zigzag ? ZIGZAG_ENCODING : 0);
+
+    /* write the number of values */
+    data = varint_encode(data, n);
+
+    /* encode values */
+    data = encode_array(data, &stats, values, n);
+
+    Assert(data == (uint8_t *) out + size);
+    return PointerGetDatum(out);
 }
 
 PG_FUNCTION_INFO_V1(intarr_out);
@@ -526,7 +2476,7 @@ Datum intarr_out(PG_FUNCTION_ARGS)
     data = varint_decode(data, &n);
 
     /* iterate through values */
-    decoder_iter_init(&it, encoding, data);
+    decoder_iter_init(&it, encoding, data, n);
     initStringInfo(&str);
     appendStringInfoChar(&str, '{');
     for (uint32_t i = 0; i < n; ++i) {
@@ -558,9 +2508,949 @@ Datum intarr_get_val(PG_FUNCTION_ARGS)
         PG_RETURN_NULL();
 
     /* iterate through values */
-    decoder_iter_init(&it, encoding, data);
+    decoder_iter_init(&it, encoding, data, n);
     for (int32_t i = 0; i < idx; ++i)
         res = decoder_iter_next(&it);
 
     PG_RETURN_INT64(res);
 }
+
+PG_FUNCTION_INFO_V1(intarr_append);
+Datum intarr_append(PG_FUNCTION_ARGS)
+{
+    struct varlena *in = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    int64_t   val = PG_GETARG_INT64(1);
+    uint8_t  *data = (uint8_t *) VARDATA(in);
+    uint8_t  *end = (uint8_t *) in + VARSIZE(in);
+    uint64_t  n;
+    uint8_t   encoding;
+    uint64_t  enc;
+    int64_t  *values;
+
+    /* read the encoding and the number of items */
+    encoding = *data++;
+    data = varint_decode(data, &n);
+
+    if (encoding & ZIGZAG_ENCODING)
+        enc = zigzag_encode(val);
+    else
+        enc = val;
+
+    /*
+     * If the encoding allows, append the value to a copy of encoded data.
+     *
+     * To keep the encoding canonical, the result must be encoded the same way
+     * create_intarr_internal() would encode it. That requires the stats of
+     * the encoded values, which are collected in a single pass without
+     * decoding them into an array.
+     */
+    if (val >= 0 || (encoding & ZIGZAG_ENCODING)) {
+        struct varlena *out;
+        uint8_t    *buf;
+
+        switch (encoding & 0x7)
+        {
+            case VARINT_ENCODING:
+                {
+                    uint64_t    max = enc;
+                    uint64_t    tmp;
+                    uint8_t    *p = data;
+                    uint8_t     num_bits;
+
+                    for (uint64_t i = 0; i < n; ++i) {
+                        p = varint_decode(p, &tmp);
+                        max = max > tmp ? max : tmp;
+                    }
+                    num_bits = bits_required(max);
+
+                    /* bit packing would be more compact */
+                    if ((end - data) + varint_len(enc) >=
+                        (((n + 1) * num_bits + 7) >> 3) + 1)
+                        break;
+                }
+
+                out = alloc_varlena(VARHDRSZ + 1 + varint_len(n + 1) +
+                                    (end - data) + varint_len(enc));
+                buf = (uint8_t *) VARDATA(out);
+                *buf++ = encoding;
+                buf = varint_encode(buf, n + 1);
+                memcpy(buf, data, end - data);
+                buf = varint_encode(buf + (end - data), enc);
+
+                Assert(buf == (uint8_t *) out + VARSIZE(out));
+                PG_RETURN_POINTER(out);
+
+            case BITPACK_ENCODING:
+                {
+                    uint8_t     num_bits;
+                    uint8_t    *packed = read_num_bits(data, &num_bits);
+                    uint64_t    varint_size = varint_len(enc);
+                    uint64_t    packed_size = ((n + 1) * num_bits + 7) >> 3;
+                    BitpackIter it;
+
+                    if (bits_required(enc) > num_bits)
+                        break;
+
+                    bitpack_iter_init(&it, packed, num_bits, n);
+                    for (uint64_t i = 0; i < n; ++i)
+                        varint_size += varint_len(bitpack_iter_next(&it));
+
+                    /* varint would be more compact */
+                    if (varint_size < packed_size + 1)
+                        break;
+
+                    /*
+                     * bitpack_set() keeps the bits around the new value, so
+                     * the bytes past the copied data must be zeroed.
+                     */
+                    out = alloc_varlena(VARHDRSZ + 1 + varint_len(n + 1) + 1 +
+                                        packed_size);
+                    buf = (uint8_t *) VARDATA(out);
+                    *buf++ = encoding;
+                    buf = varint_encode(buf, n + 1);
+                    buf = write_num_bits(buf, num_bits);
+                    memcpy(buf, packed, end - packed);
+                    memset(buf + (end - packed), 0,
+                           packed_size - (end - packed));
+                    bitpack_set(buf, n, num_bits, enc);
+                    buf += packed_size;
+
+                    Assert(buf == (uint8_t *) out + VARSIZE(out));
+                    PG_RETURN_POINTER(out);
+                }
+        }
+    }
+
+    /* Otherwise decode and encode back */
+    values = palloc(sizeof(int64_t) * (n + 1));
+    decode_array(data, encoding, values, n);
+    values[n] = val;
+
+    return create_intarr_internal(values, n + 1);
+}
+
+PG_FUNCTION_INFO_V1(intarr_from_array);
+Datum intarr_from_array(PG_FUNCTION_ARGS)
+{
+    ArrayType  *arr = PG_GETARG_ARRAYTYPE_P(0);
+    const int64_t *values;
+    uint32_t    n;
+
+    if (ARR_NDIM(arr) > 1)
+        elog(ERROR, "array must be one-dimensional");
+
+    values = array_get_int64(arr, &n, &scratch_values);
+
+    return create_intarr_internal(values, n);
+}
+
+PG_FUNCTION_INFO_V1(intarr_to_int8_array);
+Datum intarr_to_int8_array(PG_FUNCTION_ARGS)
+{
+    struct varlena *in = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    uint8_t    *data = (uint8_t *) VARDATA(in);
+    ArrayType  *arr;
+    uint64_t    n;
+    uint8_t     encoding;
+    int         dims[1];
+
+    /* read the encoding and the number of items */
+    encoding = *data++;
+    data = varint_decode(data, &n);
+
+    dims[0] = n;
+    arr = new_array(INT8OID, sizeof(int64_t), 1, dims);
+    if (n > 0)
+        decode_array(data, encoding, (int64_t *) ARR_DATA_PTR(arr), n);
+
+    PG_RETURN_ARRAYTYPE_P(arr);
+}
+
+PG_FUNCTION_INFO_V1(intarr_to_int4_array);
+Datum intarr_to_int4_array(PG_FUNCTION_ARGS)
+{
+    struct varlena *in = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    uint8_t    *data = (uint8_t *) VARDATA(in);
+    ArrayType  *arr;
+    int32_t    *out;
+    uint64_t    n;
+    uint8_t     encoding;
+    int         dims[1];
+    DecoderIter it;
+    int64_t     block[DECODE_BLOCK_SIZE];
+
+    /* read the encoding and the number of items */
+    encoding = *data++;
+    data = varint_decode(data, &n);
+
+    dims[0] = n;
+    arr = new_array(INT4OID, sizeof(int32_t), 1, dims);
+    if (n == 0)
+        PG_RETURN_ARRAYTYPE_P(arr);
+
+    /* decode a block of values at a time and narrow them */
+    out = (int32_t *) ARR_DATA_PTR(arr);
+    decoder_iter_init(&it, encoding, data, n);
+    for (uint64_t i = 0; i < n; i += DECODE_BLOCK_SIZE) {
+        uint32_t cnt = Min(n - i, DECODE_BLOCK_SIZE);
+
+        decoder_iter_next_block(&it, block, cnt);
+        for (uint32_t j = 0; j < cnt; ++j) {
+            if (block[j] < INT32_MIN || block[j] > INT32_MAX)
+                elog(ERROR, "integer out of range");
+            out[i + j] = (int32_t) block[j];
+        }
+    }
+
+    PG_RETURN_ARRAYTYPE_P(arr);
+}
+
+/*
+ * intmap_cmp_internal
+ *      Compare maps as sequences of entries ordered by key. Entries are
+ *      compared by key first and then by values column by column; if one map
+ *      is a prefix of the other, the shorter one is smaller. Maps with fewer
+ *      value columns are smaller than maps with more columns.
+ *
+ * Keys and values are decoded a block at a time and comparison stops at the
+ * first block that differs.
+ */
+static int intmap_cmp_internal(struct varlena *a, struct varlena *b)
+{
+    IntMapHeader ha, hb;
+    uint8_t    *da, *db;
+    DecoderIter ita[INTMAP_MAX_COLUMNS + 1], itb[INTMAP_MAX_COLUMNS + 1];
+    int64_t    *bufa, *bufb;
+    uint64_t    n;
+    int         ncols;      /* keys plus value columns */
+    int         res = 0;
+
+    /* equal contents are encoded the same way */
+    if (VARSIZE(a) == VARSIZE(b) && memcmp(a, b, VARSIZE(a)) == 0)
+        return 0;
+
+    da = intmap_read_header((uint8_t *) VARDATA(a), &ha);
+    db = intmap_read_header((uint8_t *) VARDATA(b), &hb);
+
+    if (ha.ncols != hb.ncols)
+        return ha.ncols < hb.ncols ? -1 : 1;
+
+    ncols = ha.ncols + 1;
+    decoder_iter_init(&ita[0], ha.key_enc, da, ha.nitems);
+    decoder_iter_init(&itb[0], hb.key_enc, db, hb.nitems);
+    for (int c = 1; c < ncols; ++c) {
+        decoder_iter_init(&ita[c], ha.val_enc[c - 1], da + ha.valoff[c - 1], ha.nitems);
+        decoder_iter_init(&itb[c], hb.val_enc[c - 1], db + hb.valoff[c - 1], hb.nitems);
+    }
+
+    bufa = palloc(sizeof(int64_t) * DECODE_BLOCK_SIZE * 2);
+    bufb = bufa + DECODE_BLOCK_SIZE;
+
+    n = Min(ha.nitems, hb.nitems);
+    for (uint64_t i = 0; i < n && res == 0; i += DECODE_BLOCK_SIZE) {
+        uint32_t    cnt = Min(n - i, DECODE_BLOCK_SIZE);
+        uint32_t    first = cnt;    /* first entry that differs */
+
+        /*
+         * Keys and value columns are compared in order, so a column only
+         * decides the result if it differs before the first difference
+         * found so far.
+         */
+        for (int c = 0; c < ncols; ++c) {
+            decoder_iter_next_block(&ita[c], bufa, cnt);
+            decoder_iter_next_block(&itb[c], bufb, cnt);
+
+            for (uint32_t j = 0; j < first; ++j) {
+                if (bufa[j] != bufb[j]) {
+                    first = j;
+                    res = bufa[j] < bufb[j] ? -1 : 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    pfree(bufa);
+
+    if (res == 0 && ha.nitems != hb.nitems)
+        res = ha.nitems < hb.nitems ? -1 : 1;
+
+    return res;
+}
+
+/*
+ * intmap_canonical
+ *      Get the map in the canonical form, i.e. encoded with the default layout
+ *      by the current version. Maps that already are in this form are
+ *      returned as is.
+ */
+static struct varlena *intmap_canonical(struct varlena *in)
+{
+    IntMapHeader h;
+    uint8_t    *data;
+    int64_t    *keys, *values;
+
+    data = intmap_read_header((uint8_t *) VARDATA(in), &h);
+    if (h.version == INTMAP_VERSION &&
+        !(h.flags & (INTMAP_FLAG_HASH | INTMAP_FLAG_BLOOM)))
+        return in;
+
+    keys = palloc(sizeof(int64_t) * (h.nitems * (h.ncols + 1) + 1));
+    values = keys + h.nitems;
+    intmap_decode(data, &h, keys, values);
+
+    return (struct varlena *)
+        DatumGetPointer(create_intmap_internal(keys, values, h.nitems,
+                                               h.ncols, 0));
+}
+
+/*
+ * intmap_eq_internal
+ *      Same contents encoded by the same version with the same flags produce
+ *      the same bytes, so only maps that differ in those need decoding.
+ */
+static bool intmap_eq_internal(struct varlena *a, struct varlena *b)
+{
+    IntMapHeader ha, hb;
+
+    if (VARSIZE(a) == VARSIZE(b) && memcmp(a, b, VARSIZE(a)) == 0)
+        return true;
+
+    intmap_read_header((uint8_t *) VARDATA(a), &ha);
+    intmap_read_header((uint8_t *) VARDATA(b), &hb);
+    if (ha.version == hb.version && ha.flags == hb.flags)
+        return false;
+
+    return intmap_cmp_internal(a, b) == 0;
+}
+
+PG_FUNCTION_INFO_V1(intmap_eq);
+Datum intmap_eq(PG_FUNCTION_ARGS)
+{
+    struct varlena *a = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    struct varlena *b = PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+    bool        res = intmap_eq_internal(a, b);
+
+    PG_FREE_IF_COPY(a, 0);
+    PG_FREE_IF_COPY(b, 1);
+    PG_RETURN_BOOL(res);
+}
+
+PG_FUNCTION_INFO_V1(intmap_ne);
+Datum intmap_ne(PG_FUNCTION_ARGS)
+{
+    struct varlena *a = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    struct varlena *b = PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+    bool        res = !intmap_eq_internal(a, b);
+
+    PG_FREE_IF_COPY(a, 0);
+    PG_FREE_IF_COPY(b, 1);
+    PG_RETURN_BOOL(res);
+}
+
+PG_FUNCTION_INFO_V1(intmap_cmp);
+Datum intmap_cmp(PG_FUNCTION_ARGS)
+{
+    struct varlena *a = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    struct varlena *b = PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+    int         res = intmap_cmp_internal(a, b);
+
+    PG_FREE_IF_COPY(a, 0);
+    PG_FREE_IF_COPY(b, 1);
+    PG_RETURN_INT32(res);
+}
+
+PG_FUNCTION_INFO_V1(intmap_lt);
+Datum intmap_lt(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(DatumGetInt32(intmap_cmp(fcinfo)) < 0);
+}
+
+PG_FUNCTION_INFO_V1(intmap_le);
+Datum intmap_le(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(DatumGetInt32(intmap_cmp(fcinfo)) <= 0);
+}
+
+PG_FUNCTION_INFO_V1(intmap_gt);
+Datum intmap_gt(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(DatumGetInt32(intmap_cmp(fcinfo)) > 0);
+}
+
+PG_FUNCTION_INFO_V1(intmap_ge);
+Datum intmap_ge(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(DatumGetInt32(intmap_cmp(fcinfo)) >= 0);
+}
+
+/*
+ * intmap_hash
+ *      Hash the encoded bytes of the canonical form.
+ */
+PG_FUNCTION_INFO_V1(intmap_hash);
+Datum intmap_hash(PG_FUNCTION_ARGS)
+{
+    struct varlena *in = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    struct varlena *c = intmap_canonical(in);
+    Datum       res;
+
+    res = hash_any((unsigned char *) VARDATA(c), VARSIZE(c) - VARHDRSZ);
+
+    if (c != in)
+        pfree(c);
+    PG_FREE_IF_COPY(in, 0);
+    PG_RETURN_DATUM(res);
+}
+
+/*
+ * intarr_cmp_internal
+ *      Compare arrays element by element, if one array is a prefix of the
+ *      other, the shorter one is smaller.
+ */
+static int intarr_cmp_internal(struct varlena *a, struct varlena *b)
+{
+    uint8_t    *da = (uint8_t *) VARDATA(a);
+    uint8_t    *db = (uint8_t *) VARDATA(b);
+    uint8_t     enc_a, enc_b;
+    uint64_t    na, nb, n;
+    DecoderIter ita, itb;
+    int64_t     bufa[DECODE_BLOCK_SIZE], bufb[DECODE_BLOCK_SIZE];
+
+    /* equal contents are encoded the same way */
+    if (VARSIZE(a) == VARSIZE(b) && memcmp(a, b, VARSIZE(a)) == 0)
+        return 0;
+
+    enc_a = *da++;
+    da = varint_decode(da, &na);
+    enc_b = *db++;
+    db = varint_decode(db, &nb);
+
+    n = Min(na, nb);
+    if (n > 0) {
+        decoder_iter_init(&ita, enc_a, da, na);
+        decoder_iter_init(&itb, enc_b, db, nb);
+    }
+
+    for (uint64_t i = 0; i < n; i += DECODE_BLOCK_SIZE) {
+        uint32_t cnt = Min(n - i, DECODE_BLOCK_SIZE);
+
+        decoder_iter_next_block(&ita, bufa, cnt);
+        decoder_iter_next_block(&itb, bufb, cnt);
+        for (uint32_t j = 0; j < cnt; ++j)
+            if (bufa[j] != bufb[j])
+                return bufa[j] < bufb[j] ? -1 : 1;
+    }
+
+    if (na != nb)
+        return na < nb ? -1 : 1;
+    return 0;
+}
+
+PG_FUNCTION_INFO_V1(intarr_eq);
+Datum intarr_eq(PG_FUNCTION_ARGS)
+{
+    struct varlena *a = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    struct varlena *b = PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+    bool        res;
+
+    /*
+     * intarr has no version byte and arrays written by older versions may
+     * have different bytes for the same elements, so unless the bytes match
+     * elements are compared
+     */
+    res = intarr_cmp_internal(a, b) == 0;
+
+    PG_FREE_IF_COPY(a, 0);
+    PG_FREE_IF_COPY(b, 1);
+    PG_RETURN_BOOL(res);
+}
+
+PG_FUNCTION_INFO_V1(intarr_ne);
+Datum intarr_ne(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(!DatumGetBool(intarr_eq(fcinfo)));
+}
+
+PG_FUNCTION_INFO_V1(intarr_cmp);
+Datum intarr_cmp(PG_FUNCTION_ARGS)
+{
+    struct varlena *a = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    struct varlena *b = PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+    int         res = intarr_cmp_internal(a, b);
+
+    PG_FREE_IF_COPY(a, 0);
+    PG_FREE_IF_COPY(b, 1);
+    PG_RETURN_INT32(res);
+}
+
+PG_FUNCTION_INFO_V1(intarr_lt);
+Datum intarr_lt(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(DatumGetInt32(intarr_cmp(fcinfo)) < 0);
+}
+
+PG_FUNCTION_INFO_V1(intarr_le);
+Datum intarr_le(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(DatumGetInt32(intarr_cmp(fcinfo)) <= 0);
+}
+
+PG_FUNCTION_INFO_V1(intarr_gt);
+Datum intarr_gt(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(DatumGetInt32(intarr_cmp(fcinfo)) > 0);
+}
+
+PG_FUNCTION_INFO_V1(intarr_ge);
+Datum intarr_ge(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(DatumGetInt32(intarr_cmp(fcinfo)) >= 0);
+}
+
+/*
+ * intarr_hash
+ *      Hash of the decoded elements, consistent with intarr_eq() for arrays
+ *      encoded by any version.
+ */
+PG_FUNCTION_INFO_V1(intarr_hash);
+Datum intarr_hash(PG_FUNCTION_ARGS)
+{
+    struct varlena *in = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    uint8_t    *data = (uint8_t *) VARDATA(in);
+    uint8_t     encoding;
+    uint64_t    n;
+    uint64_t    res;
+    DecoderIter it;
+    int64_t     block[DECODE_BLOCK_SIZE];
+
+    encoding = *data++;
+    data = varint_decode(data, &n);
+
+    res = hash64(n);
+    if (n > 0)
+        decoder_iter_init(&it, encoding, data, n);
+    for (uint64_t i = 0; i < n; i += DECODE_BLOCK_SIZE) {
+        uint32_t cnt = Min(n - i, DECODE_BLOCK_SIZE);
+
+        decoder_iter_next_block(&it, block, cnt);
+        for (uint32_t j = 0; j < cnt; ++j)
+            res = hash64(res ^ (uint64_t) block[j]);
+    }
+
+    PG_FREE_IF_COPY(in, 0);
+    PG_RETURN_INT32((int32) (res ^ (res >> 32)));
+}
+
+
+/*
+ * Statistics
+ *
+ * Besides the standard statistics of the maps themselves, ANALYZE collects
+ * the most common keys (STATISTIC_KIND_MCELEM slot, keys sorted to allow
+ * binary search, frequencies followed by min, max and null frequencies as
+ * for arrays) and a histogram of the number of keys per map
+ * (STATISTIC_KIND_DECHIST slot, followed by the average).
+ */
+
+/* selectivity of a key lookup without statistics, same as for arrays */
+#define DEFAULT_INTMAP_KEY_SEL  0.005
+
+/* statistics target of the column, moved out of the attribute in PG17 */
+#if PG_VERSION_NUM >= 170000
+#define STATS_TARGET(stats)     ((stats)->attstattarget)
+#else
+#define STATS_TARGET(stats)     ((stats)->attr->attstattarget)
+#endif
+
+typedef struct
+{
+    AnalyzeAttrComputeStatsFunc std_compute_stats;
+    void       *std_extra_data;
+} IntMapAnalyzeExtraData;
+
+/* lossy counting entry */
+typedef struct
+{
+    int64_t     key;
+    int         frequency;
+    int         delta;
+} KeyTrackItem;
+
+static int key_track_freq_cmp(const void *a, const void *b)
+{
+    const KeyTrackItem *ia = *(const KeyTrackItem *const *) a;
+    const KeyTrackItem *ib = *(const KeyTrackItem *const *) b;
+
+    return ib->frequency - ia->frequency;
+}
+
+static int key_track_key_cmp(const void *a, const void *b)
+{
+    int64_t ka = (*(const KeyTrackItem *const *) a)->key;
+    int64_t kb = (*(const KeyTrackItem *const *) b)->key;
+
+    return ka < kb ? -1 : ka > kb;
+}
+
+static int int_cmp(const void *a, const void *b)
+{
+    int ia = *(const int *) a;
+    int ib = *(const int *) b;
+
+    return ia < ib ? -1 : ia > ib;
+}
+
+/*
+ * prune_keys_tab
+ *      Remove keys that can't be frequent enough (lossy counting).
+ */
+static void prune_keys_tab(HTAB *keys_tab, int b_current)
+{
+    HASH_SEQ_STATUS scan_status;
+    KeyTrackItem *item;
+
+    hash_seq_init(&scan_status, keys_tab);
+    while ((item = (KeyTrackItem *) hash_seq_search(&scan_status)) != NULL) {
+        if (item->frequency + item->delta <= b_current)
+            hash_search(keys_tab, &item->key, HASH_REMOVE, NULL);
+    }
+}
+
+/*
+ * compute_intmap_stats
+ *      Compute standard statistics and then most common keys and a histogram
+ *      of the number of keys per map. Keys are counted with the Lossy
+ *      Counting algorithm, the same way ANALYZE counts array elements.
+ */
+static void compute_intmap_stats(VacAttrStats *stats,
+                                 AnalyzeAttrFetchFunc fetchfunc,
+                                 int samplerows, double totalrows)
+{
+    IntMapAnalyzeExtraData *extra_data = stats->extra_data;
+    int         num_mcelem;
+    int         bucket_width;
+    int         b_current = 1;
+    int64       key_no = 0;
+    int         nonnull_cnt = 0;
+    int        *key_counts;
+    HASHCTL     key_hash_ctl;
+    HTAB       *keys_tab;
+    int         slot_idx;
+
+    /* standard statistics of whole maps */
+    stats->extra_data = extra_data->std_extra_data;
+    extra_data->std_compute_stats(stats, fetchfunc, samplerows, totalrows);
+    stats->extra_data = extra_data;
+
+    /* same targets as for array elements */
+    num_mcelem = STATS_TARGET(stats) * 10;
+    bucket_width = (num_mcelem + 10) * 1000 / 7;
+
+    MemSet(&key_hash_ctl, 0, sizeof(key_hash_ctl));
+    key_hash_ctl.keysize = sizeof(int64_t);
+    key_hash_ctl.entrysize = sizeof(KeyTrackItem);
+    key_hash_ctl.hcxt = CurrentMemoryContext;
+    keys_tab = hash_create("Analyzed intmap keys", num_mcelem, &key_hash_ctl,
+                           HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    key_counts = palloc(sizeof(int) * samplerows);
+
+    for (int i = 0; i < samplerows; ++i) {
+        Datum       value;
+        bool        isnull;
+        struct varlena *map;
+        uint8_t    *data;
+        IntMapHeader h;
+        DecoderIter it;
+        int64_t     prev_key = 0;
+        int         nkeys;
+
+        vacuum_delay_point();
+
+        value = fetchfunc(stats, i, &isnull);
+        if (isnull)
+            continue;
+
+        map = PG_DETOAST_DATUM(value);
+        data = intmap_read_header((uint8_t *) VARDATA(map), &h);
+
+        /*
+         * Keys may repeat within a map, but they are sorted, so duplicates
+         * are adjacent. Each distinct key is counted once per map.
+         */
+        nkeys = 0;
+        decoder_iter_init(&it, h.key_enc, data, h.nitems);
+        for (uint64_t j = 0; j < h.nitems; ++j) {
+            int64_t     key = decoder_iter_next(&it);
+            KeyTrackItem *item;
+            bool        found;
+
+            if (j > 0 && key == prev_key)
+                continue;
+            prev_key = key;
+            nkeys++;
+
+            item = hash_search(keys_tab, &key, HASH_ENTER, &found);
+            if (found)
+                item->frequency++;
+            else {
+                item->frequency = 1;
+                item->delta = b_current - 1;
+            }
+
+            if (++key_no % bucket_width == 0) {
+                prune_keys_tab(keys_tab, b_current);
+                b_current++;
+            }
+        }
+
+        key_counts[nonnull_cnt++] = nkeys;
+
+        if ((Pointer) map != DatumGetPointer(value))
+            pfree(map);
+    }
+
+    if (nonnull_cnt == 0)
+        return;
+
+    slot_idx = 0;
+    while (slot_idx < STATISTIC_NUM_SLOTS && stats->stakind[slot_idx] != 0)
+        slot_idx++;
+    if (slot_idx > STATISTIC_NUM_SLOTS - 2)
+        elog(ERROR, "insufficient pg_statistic slots for intmap stats");
+
+    /* most common keys */
+    {
+        HASH_SEQ_STATUS scan_status;
+        KeyTrackItem *item;
+        KeyTrackItem **sorted;
+        int         nitems = 0;
+        int         cutoff_freq = 9 * key_no / bucket_width;
+
+        sorted = palloc(sizeof(KeyTrackItem *) * hash_get_num_entries(keys_tab));
+        hash_seq_init(&scan_status, keys_tab);
+        while ((item = (KeyTrackItem *) hash_seq_search(&scan_status)) != NULL)
+            if (item->frequency > cutoff_freq)
+                sorted[nitems++] = item;
+
+        if (nitems > num_mcelem) {
+            qsort(sorted, nitems, sizeof(KeyTrackItem *), key_track_freq_cmp);
+            nitems = num_mcelem;
+        }
+
+        if (nitems > 0) {
+            MemoryContext old_context;
+            Datum      *values;
+            float4     *freqs;
+            int         minfreq = sorted[0]->frequency,
+                        maxfreq = sorted[0]->frequency;
+
+            for (int i = 1; i < nitems; ++i) {
+                minfreq = Min(minfreq, sorted[i]->frequency);
+                maxfreq = Max(maxfreq, sorted[i]->frequency);
+            }
+
+            /* sort by key for binary search */
+            qsort(sorted, nitems, sizeof(KeyTrackItem *), key_track_key_cmp);
+
+            old_context = MemoryContextSwitchTo(stats->anl_context);
+            values = palloc(sizeof(Datum) * nitems);
+            freqs = palloc(sizeof(float4) * (nitems + 3));
+            for (int i = 0; i < nitems; ++i) {
+                values[i] = Int64GetDatum(sorted[i]->key);
+                freqs[i] = (double) sorted[i]->frequency / (double) nonnull_cnt;
+            }
+            freqs[nitems] = (double) minfreq / (double) nonnull_cnt;
+            freqs[nitems + 1] = (double) maxfreq / (double) nonnull_cnt;
+            freqs[nitems + 2] = 0.0;    /* keys are never NULL */
+            MemoryContextSwitchTo(old_context);
+
+            stats->stakind[slot_idx] = STATISTIC_KIND_MCELEM;
+            stats->staop[slot_idx] =
+                lookup_type_cache(INT8OID, TYPECACHE_EQ_OPR)->eq_opr;
+            stats->stanumbers[slot_idx] = freqs;
+            stats->numnumbers[slot_idx] = nitems + 3;
+            stats->stavalues[slot_idx] = values;
+            stats->numvalues[slot_idx] = nitems;
+            stats->statypid[slot_idx] = INT8OID;
+            stats->statyplen[slot_idx] = sizeof(int64);
+            stats->statypbyval[slot_idx] = FLOAT8PASSBYVAL;
+            stats->statypalign[slot_idx] = 'd';
+            slot_idx++;
+        }
+    }
+
+    /* histogram of the number of keys per map followed by the average */
+    {
+        MemoryContext old_context;
+        float4     *hist;
+        int         num_hist = Max(STATS_TARGET(stats), 2);
+        double      delta = (double) (nonnull_cnt - 1) / (num_hist - 1);
+
+        qsort(key_counts, nonnull_cnt, sizeof(int), int_cmp);
+
+        old_context = MemoryContextSwitchTo(stats->anl_context);
+        hist = palloc(sizeof(float4) * (num_hist + 1));
+        for (int i = 0; i < num_hist; ++i)
+            hist[i] = key_counts[(int) (i * delta)];
+        hist[num_hist] = (double) key_no / (double) nonnull_cnt;
+        MemoryContextSwitchTo(old_context);
+
+        stats->stakind[slot_idx] = STATISTIC_KIND_DECHIST;
+        stats->staop[slot_idx] =
+            lookup_type_cache(INT8OID, TYPECACHE_EQ_OPR)->eq_opr;
+        stats->stanumbers[slot_idx] = hist;
+        stats->numnumbers[slot_idx] = num_hist + 1;
+    }
+}
+
+PG_FUNCTION_INFO_V1(intmap_typanalyze);
+Datum intmap_typanalyze(PG_FUNCTION_ARGS)
+{
+    VacAttrStats *stats = (VacAttrStats *) PG_GETARG_POINTER(0);
+    IntMapAnalyzeExtraData *extra_data;
+
+    /* standard statistics rely on the default btree opclass */
+    if (!std_typanalyze(stats))
+        PG_RETURN_BOOL(false);
+
+    extra_data = palloc(sizeof(IntMapAnalyzeExtraData));
+    extra_data->std_compute_stats = stats->compute_stats;
+    extra_data->std_extra_data = stats->extra_data;
+
+    stats->compute_stats = compute_intmap_stats;
+    stats->extra_data = extra_data;
+
+    PG_RETURN_BOOL(true);
+}
+
+/*
+ * intmap_key_selectivity
+ *      Fraction of rows whose maps contain the key.
+ */
+static Selectivity intmap_key_selectivity(VariableStatData *vardata,
+                                          int64_t key)
+{
+    Form_pg_statistic stats;
+    AttStatsSlot sslot;
+    Selectivity sel = DEFAULT_INTMAP_KEY_SEL;
+
+    if (!HeapTupleIsValid(vardata->statsTuple))
+        return sel;
+    stats = (Form_pg_statistic) GETSTRUCT(vardata->statsTuple);
+
+    if (get_attstatsslot(&sslot, vardata->statsTuple,
+                         STATISTIC_KIND_MCELEM, InvalidOid,
+                         ATTSTATSSLOT_VALUES | ATTSTATSSLOT_NUMBERS)) {
+        /* the last three numbers are min, max and null key frequencies */
+        if (sslot.nnumbers == sslot.nvalues + 3) {
+            int lo = 0,
+                hi = sslot.nvalues;
+
+            while (lo < hi) {
+                int mid = (lo + hi) / 2;
+
+                if (DatumGetInt64(sslot.values[mid]) < key)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+
+            if (lo < sslot.nvalues && DatumGetInt64(sslot.values[lo]) == key)
+                sel = sslot.numbers[lo];
+            else
+                /* not a common key, so it's rarer than the least common one */
+                sel = Min(DEFAULT_INTMAP_KEY_SEL,
+                          sslot.numbers[sslot.nvalues] / 2);
+        }
+        free_attstatsslot(&sslot);
+    }
+
+    /* frequencies are relative to non-null maps */
+    return sel * (1.0 - stats->stanullfrac);
+}
+
+/*
+ * intmap_exists_sel
+ *      Restriction selectivity of "intmap ? key".
+ */
+PG_FUNCTION_INFO_V1(intmap_exists_sel);
+Datum intmap_exists_sel(PG_FUNCTION_ARGS)
+{
+    PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+    List       *args = (List *) PG_GETARG_POINTER(2);
+    int         varRelid = PG_GETARG_INT32(3);
+    VariableStatData vardata;
+    Node       *other;
+    bool        varonleft;
+    Selectivity sel;
+
+    if (!get_restriction_variable(root, args, varRelid,
+                                  &vardata, &other, &varonleft))
+        PG_RETURN_FLOAT8(DEFAULT_INTMAP_KEY_SEL);
+
+    /* the key must be a constant */
+    if (!varonleft || !IsA(other, Const)) {
+        ReleaseVariableStats(vardata);
+        PG_RETURN_FLOAT8(DEFAULT_INTMAP_KEY_SEL);
+    }
+
+    if (((Const *) other)->constisnull) {
+        ReleaseVariableStats(vardata);
+        PG_RETURN_FLOAT8(0.0);
+    }
+
+    sel = intmap_key_selectivity(&vardata,
+                                 DatumGetInt64(((Const *) other)->constvalue));
+    ReleaseVariableStats(vardata);
+
+    CLAMP_PROBABILITY(sel);
+    PG_RETURN_FLOAT8(sel);
+}
+
+/*
+ * intmap_exists_joinsel
+ *      Join selectivity of "intmap ? key".
+ *
+ * A map holds avg_keys keys on average. Assuming they are spread evenly over
+ * nd distinct values of the joined key, a random pair of rows matches with
+ * probability avg_keys / nd.
+ */
+PG_FUNCTION_INFO_V1(intmap_exists_joinsel);
+Datum intmap_exists_joinsel(PG_FUNCTION_ARGS)
+{
+    PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+    List       *args = (List *) PG_GETARG_POINTER(2);
+    SpecialJoinInfo *sjinfo = (SpecialJoinInfo *) PG_GETARG_POINTER(4);
+    VariableStatData map_data, key_data;
+    bool        join_is_reversed;
+    AttStatsSlot sslot;
+    Selectivity sel = DEFAULT_INTMAP_KEY_SEL;
+
+    get_join_variables(root, args, sjinfo, &map_data, &key_data,
+                       &join_is_reversed);
+
+    if (HeapTupleIsValid(map_data.statsTuple) &&
+        get_attstatsslot(&sslot, map_data.statsTuple,
+                         STATISTIC_KIND_DECHIST, InvalidOid,
+                         ATTSTATSSLOT_NUMBERS)) {
+        Form_pg_statistic stats;
+        double      avg_keys = sslot.numbers[sslot.nnumbers - 1];
+        double      nd;
+        bool        isdefault;
+
+        stats = (Form_pg_statistic) GETSTRUCT(map_data.statsTuple);
+        nd = get_variable_numdistinct(&key_data, &isdefault);
+        if (!isdefault && nd > 0)
+            sel = Min(avg_keys / nd, 1.0) * (1.0 - stats->stanullfrac);
+
+        free_attstatsslot(&sslot);
+    }
+
+    ReleaseVariableStats(map_data);
+    ReleaseVariableStats(key_data);
+
+    CLAMP_PROBABILITY(sel);
+    PG_RETURN_FLOAT8(sel);
+}
@@ -11,5 +11,159 @@ select '1=>-10496585469345, 2=>10, 3=>1'::intmap->1;
 select intmap(array[1, null], array[5, null]);
 select intmap(array[1, 2], array[5, 10]);
 
+select intmap_meta(intmap(array[5, 1, 3], array[50, 10, 30], 'hash'));
+select intmap(array[5, 1, 3], array[50, 10, 30], 'hash');
+select intmap(array[5, 1, 3], array[50, 10, 30], layout => 'hash')->3;
+select intmap(array[5, 1, 3], array[50, 10, 30], layout => 'hash')->4;
+select intmap(array[-5, 1, 3], array[50, -10, 30], 'hash')->(-5);
+select intmap(array[1], array[1], 'foo');
+
+select intmap_meta(intmap(array[5, 1, 3], array[50, 10, 30], bloom => true));
+select intmap(array[5, 1, 3], array[50, 10, 30], bloom => true) ? 3;
+select intmap(array[5, 1, 3], array[50, 10, 30], bloom => true) ? 4;
+select intmap(array[5, 1, 3], array[50, 10, 30], 'hash', true)->5;
+select '1=>2'::intmap ? 1, '1=>2'::intmap ? 2;
+create table bloom_test as
+    select intmap(array(select generate_series(1, 10000)),
+                  array(select generate_series(1, 10000)),
+                  bloom => true) as m;
+select m ? 5000, m ? 20000, m->5000, m->20000 from bloom_test;
+drop table bloom_test;
+
+select intmap_set('1=>10, 2=>20, 3=>30', 2, 25);
+select intmap_set('1=>10, 2=>20, 3=>30', 2, 1000);
+select intmap_set('1=>10, 2=>20, 3=>30', 0, -5);
+select intmap_set(intmap(array[1, 2], array[10, 20], 'hash', true), 5, 50)->5;
+select intmap_delete('1=>10, 2=>20, 3=>30', 2);
+select intmap_delete('1=>10, 2=>20, 3=>30', 5);
+
+select intmap_range('1=>5, 2=>1, 3=>7, 4=>5, 5=>0, 6=>9', 2, 4);
+select intmap_range('1=>5, 2=>1, 3=>7, 4=>5, 5=>0, 6=>9', 7, 10);
+select intmap_range(intmap(array[1, 2, 3], array[10, 20, 30], 'hash'), 2, 3)->3;
+select * from intmap_range_each('1=>5, 2=>1, 3=>7, 4=>5, 5=>0, 6=>9', 2, 4);
+select intmap_topn('1=>5, 2=>1, 3=>7, 4=>5, 5=>0, 6=>9', 3);
+select intmap_topn('1=>5, 2=>1, 3=>7, 4=>5, 5=>0, 6=>9', 0);
+
+select intmap(array[1, 2], array[[10, 20], [100, 200]]);
+select intmap_meta(intmap(array[1, 2], array[[10, 20], [100, 200]]));
+select intmap(array[[1, 2], [3, 4]], array[1, 2, 3, 4]);
+select '3=>{1, 2}, 1=>{5, 6}'::intmap;
+select '1=>{1, 2}, 2=>3'::intmap;
+select m->2, intmap_get_val(m, 2, 2), intmap_get_vals(m, 2)
+    from (select '1=>{10, 100}, 2=>{20, 200}'::intmap as m) t;
+select intmap_get_val('1=>{10, 100}', 1, 3);
+select intmap_set('1=>{10, 100}, 2=>{20, 200}', 3, array[30, 300]);
+select intmap_set('1=>{10, 100}', 1, 5);
+select intmap_delete('1=>{10, 100}, 2=>{20, 200}', 1);
+select intmap_topn('1=>{5, 1}, 2=>{7, 2}, 3=>{6, 3}', 2);
+
 select '{1, 2}'::intarr;
 select '{}'::intarr;
+select intarr_append('{1, 2}', 3);
+select intarr_append('{1, 2}', -300000);
+select intarr_append('{}', 7);
+
+select array[3, -1, 7]::intarr;
+select array[3, -1, 7]::int8[]::intarr;
+select array[1, null]::intarr;
+select '{3, -1, 7}'::intarr::int8[];
+select '{3, -1, 7}'::intarr::int4[];
+select '{}'::intarr::int8[];
+select '{1, 10000000000}'::intarr::int4[];
+select * from intmap_to_arrays('3=>30, 1=>-10, 2=>20');
+select * from intmap_to_arrays('1=>{10, 100}, 2=>{20, 200}');
+select * from intmap_to_arrays('');
+
+select '1=>10, 2=>20'::intmap = intmap(array[2, 1], array[20, 10], 'hash', true);
+select '1=>10, 2=>20'::intmap = '1=>10, 2=>21';
+select '1=>10'::intmap < '1=>10, 2=>20', '2=>1'::intmap > '1=>100', '1=>{1, 2}'::intmap > '1=>5';
+select intmap_hash('1=>10, 2=>20') = intmap_hash(intmap(array[1, 2], array[10, 20], 'hash'));
+select m, count(*)
+    from (values ('1=>10'::intmap), ('1=>10'), (intmap_set('1=>10, 2=>20', 2, 30)),
+                 (intmap_delete('1=>10, 2=>20', 2)), ('1=>10, 2=>30')) v(m)
+    group by m order by m;
+select '{1, 2}'::intarr = intarr_append('{1}', 2), '{1, 2}'::intarr < '{1, 3}', '{1, 2}'::intarr < '{1, 2, 0}';
+select a, count(*) from (values ('{1, 2}'::intarr), (intarr_append('{1}', 2)), ('{}')) v(a)
+    group by a order by a;
+
+create table stats_test as
+    select intmap(array[1, 2, i % 3 + 10], array[1, 2, 3]) as m
+    from generate_series(1, 3000) i;
+analyze stats_test;
+select most_common_elems,
+       array(select round(f::numeric, 2) from unnest(most_common_elem_freqs) f) as freqs,
+       elem_count_histogram[array_upper(elem_count_histogram, 1)] as avg_keys
+    from pg_stats where tablename = 'stats_test';
+create function explain_rows(query text) returns int8 language plpgsql as $$
+declare
+    plan json;
+begin
+    execute 'explain (format json) ' || query into plan;
+    return (plan->0->'Plan'->>'Plan Rows')::int8;
+end
+$$;
+select explain_rows('select * from stats_test where m ? 1');
+select explain_rows('select * from stats_test where m ? 10');
+select explain_rows('select * from stats_test where m ? 5');
+drop table stats_test;
+drop function explain_rows(text);
+
+create table lookup_test as
+    select i as id, intmap(array(select generate_series(1, 20000)),
+                           array(select generate_series(1, 20000) * i)) as m
+    from generate_series(1, 3) i;
+insert into lookup_test values (4, '1=>-1, 3=>-3, 19999=>-19999');
+select id, m->1, m->2, m->3, m->19999, m->20001, m ? 2, intmap_get_vals(m, 3)
+    from lookup_test order by id;
+drop table lookup_test;
+create table lookup_rows as
+    select i, intmap(array[1, 2, 3, i + 3], array[i, 2 * i, 3 * i, -i],
+                     bloom => i % 2 = 0) as m
+    from generate_series(1, 1000) i, generate_series(1, 2) j;
+select sum(m->1), sum(m->2), sum(m->3), sum(m->(i + 3)),
+       count(*) filter (where m ? 500)
+    from lookup_rows;
+drop table lookup_rows;
+
+select nitems, layout, columns, header_bytes, bloom_bytes, keys_bytes,
+       values_bytes, hash_bytes, total_bytes
+    from (values (1, '85469345=>3, 2=>153, 3=>123'::intmap),
+                 (2, '-85469345=>3, 2=>153, 3=>-123'),
+                 (3, '1=>{10, 100}, 2=>{20, -200}'),
+                 (4, intmap(array[5, 1, 3], array[50, 10, 30], 'hash', true)),
+                 (5, '')) v(id, m), intmap_info(m)
+    order by id;
+select keys_encoding, keys_bits, values_encodings, values_bits,
+       varint_bytes, bitpack_bytes, best_bytes
+    from (values (1, '85469345=>3, 2=>153, 3=>123'::intmap),
+                 (2, '-85469345=>3, 2=>153, 3=>-123'),
+                 (3, '1=>{10, 100}, 2=>{20, -200}'),
+                 (4, intmap(array[5, 1, 3], array[50, 10, 30], 'hash', true)),
+                 (5, '')) v(id, m), intmap_info(m)
+    order by id;
+create table storage_test (id int, m intmap);
+insert into storage_test values
+    (1, '85469345=>3, 2=>153, 3=>123'), (2, '-85469345=>3, 2=>153, 3=>-123'),
+    (3, null), (4, intmap(array[5, 1, 3], array[50, 10, 30], 'hash', true)),
+    (5, '');
+select maps, nitems, hash_maps, stored_bytes, total_bytes, best_bytes,
+       max_keys_bits, max_values_bits
+    from intmap_storage_report('storage_test', 'm');
+select header_bytes, bloom_bytes, keys_bytes, values_bytes, hash_bytes,
+       varint_bytes, bitpack_bytes
+    from intmap_storage_report('storage_test', 'm');
+select * from intmap_storage_report('storage_test', 'id');
+drop table storage_test;
+
+select '{-9223372036854775808, 9223372036854775807, -9223372036854775807, 9223372036854775806}'::intarr;
+select intarr_append('{-9223372036854775808, 9223372036854775807, -9223372036854775807, 9223372036854775806}', -5);
+select intmap(array[1, 2, 3, 4], array[-9223372036854775808, 9223372036854775807, -9223372036854775807, 9223372036854775806]::int8[], 'hash')->2;
+
+select intmap_filter('1=>5, 2=>1, 3=>7, 4=>5', '>=', 5);
+select intmap_filter('1=>5, 2=>1, 3=>7, 4=>5', '>', 100);
+select intmap_filter('1=>{5, 50}, 2=>{1, 10}, 3=>{7, 70}', '<', 6);
+select intmap_filter(intmap(array[1, 2, 3], array[10, 20, 30], 'hash'), '!=', 20)->3;
+select intmap_filter('1=>5', '==', 5);
+select intmap_count_where('1=>5, 2=>1, 3=>7, 4=>5', '=', 5);
+select intmap_count_where('1=>5, 2=>-1, 3=>0', '<>', 0);
+select intmap_count_where('1=>5, 2=>1, 3=>7, 4=>5', '<', 0);